@@ -3,149 +3,994 @@
 #ifndef _BATCHER_H_
 #define _BATCHER_H_
 
-// #define _DEBUG_FLZ_
-// #define _DEBUG_FLZ_TEST_READ_
-// #define _DEBUG_FLZ_TEST_WRITE_
-// #define _DEBUG_FLZ_TEST_LOCK_
-#define _DEBUG_FLZ_TEST_UNDO_
-
 #include <string.h>
 #include <stdatomic.h>
 #include <stdio.h>
 
 #include "structs.h"
+#include "desc_func.h"
 #include "macros.h"
 #include "Mytm.h"
+#include "tm_ext.h"
+#include "simd_func.h"
+#include "trace_func.h"
+#include "log_func.h"
 
-static inline Segment* findSegment(const Region * region, const void* source) {
-        #ifdef _DEBUG_FLZ_TEST_FIND_
-        printf("Looking for %p\n", source);
+/** Shared address handed out for the first byte of a segment.
+ * @param seg Segment to address
+ * @return Address encoding the segment id with a zero offset
+**/
+static inline void* seg_vaddr(const Segment* seg) {
+    return (void*)((uintptr_t)(seg -> id) << SEG_SHIFT);
+}
+
+/** Byte offset of a shared address inside its segment.
+ * @param source Shared address
+ * @return Offset from the first byte of the segment
+**/
+static inline size_t seg_offset(const void* source) {
+    return (uintptr_t)source & seg_offset_mask;
+}
+
+/** Page of the index, see SEG_PAGE. Pages are never freed before the region.
+ * @param region Region of the index
+ * @param page   Page number (segment id >> SEG_PAGE_SHIFT)
+ * @param grow   Whether to allocate the page if there is none yet
+ * @return First slot of the page, NULL if there is none (or no memory for it)
+**/
+static inline _Atomic(Segment*)* index_page(Region* region, ulong page, bool grow) {
+    _Atomic(Segment*)* slots = atomic_load(&(region -> index[page]));
+    if (slots != NULL || !grow)
+        return slots;
+    _Atomic(Segment*)* fresh = (_Atomic(Segment*)*)calloc(SEG_PAGE, sizeof(_Atomic(Segment*)));
+    if (unlikely(fresh == NULL))
+        return NULL;
+    // another thread may have added it meanwhile
+    if (!atomic_compare_exchange_strong(&(region -> index[page]), &slots, fresh)) {
+        free(fresh);
+        return slots;
+    }
+    return fresh;
+}
+
+/** Slot of a segment registered in the index (its page exists).
+**/
+static inline _Atomic(Segment*)* index_slot(Region* region, ulong id) {
+    return index_page(region, id >> SEG_PAGE_SHIFT, false) + (id & (SEG_PAGE - 1));
+}
+
+/** Give a segment a free slot of the index (and thus its shared addresses).
+ * @param region Region to register the segment in
+ * @param seg    Segment to register
+ * @return Whether a free slot was found
+**/
+static inline bool index_insert(Region* region, Segment* seg) {
+    ulong hint = atomic_load(&(region -> index_hint));
+    // reuse the slots of the pages there are, add a page only when they are full
+    for (int grow = 0; grow <= 1; ++grow) {
+        for (ulong n = 1; n < SEG_MAX; ++n) {
+            ulong id = (hint + n) % SEG_MAX;
+            _Atomic(Segment*)* page = index_page(region, id >> SEG_PAGE_SHIFT, grow);
+            if (page == NULL) {
+                if (grow)
+                    return false;
+                n += SEG_PAGE - 1 - (id & (SEG_PAGE - 1)); // on to the next page
+                continue;
+            }
+            if (id <= start_seg_id)
+                continue;
+            Segment* expected = NULL;
+            if (atomic_compare_exchange_strong(page + (id & (SEG_PAGE - 1)), &expected, seg)) {
+                seg -> id = id;
+                atomic_store(&(region -> index_hint), id);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/** Release the slot of a segment, its addresses may be handed out again.
+ * @param region Region the segment is registered in
+ * @param seg    Segment to unregister
+**/
+static inline void index_remove(Region* region, const Segment* seg) {
+    atomic_store(index_slot(region, seg -> id), NULL);
+}
+
+/** Make a segment unreachable without handing its addresses out yet: they would lead
+ * a transaction holding an old address to whatever segment took the slot.
+ * @param region Region the segment is registered in
+ * @param seg    Segment to unregister
+**/
+static inline void index_retire(Region* region, const Segment* seg) {
+    atomic_store(index_slot(region, seg -> id), SEG_TOMBSTONE);
+}
+
+/** Bytes of data per line: a cache line, or a word if bigger.
+**/
+static inline size_t line_bytes(size_t align) {
+    return align > CACHE_LINE ? align : CACHE_LINE;
+}
+
+/** Geometry of an interleaved segment: each block holds one line of data (a cache line,
+ * or a word if bigger), then the same line of shadow, then their control words (and valid
+ * bytes), padded so that the next block starts on a line.
+ * @param align Size of a word
+ * @param line  Data bytes per block
+ * @return Bytes per block
+**/
+static inline size_t interleaved_block(size_t align, size_t* line) {
+    *line = line_bytes(align);
+    size_t words = *line / align;
+    size_t block = 2 * *line + sizeof(atomic_ulong) * words;
+    #ifdef _TO_USE_DUAL_COPY_
+    block += sizeof(uint8_t) * words;
+    #endif
+    return (block + *line - 1) / *line * *line;
+}
 
-        printf("region -> start -> data: %p\n", region -> start -> data);
+/** Bytes to allocate for a segment of the given size (header, data, shadow and control,
+ * and the heads of the version chains with _TO_USE_MVCC_).
+ * @param size   Size of the segment (in bytes)
+ * @param align  Size of a word
+ * @param layout TM_LAYOUT_*
+ * @return Size of the whole allocation
+**/
+static inline size_t Segment_bytes(size_t size, size_t align, int layout) {
+    size_t bytes;
+    if (layout == TM_LAYOUT_INTERLEAVED) {
+        size_t line;
+        size_t block = interleaved_block(align, &line);
+        size_t header = (sizeof(Segment) + line - 1) / line * line;
+        bytes = header + (size + line - 1) / line * block;
+    } else {
+        bytes = sizeof(Segment) 
+              + sizeof(atomic_ulong) * (size / align)
+              + sizeof(Word) * size * 2;
+        #ifdef _TO_USE_DUAL_COPY_
+        bytes += sizeof(uint8_t) * size;
         #endif
+    }
+    #ifdef _TO_USE_MVCC_
+    size_t lines = (size + line_bytes(align) - 1) / line_bytes(align);
+    bytes = (bytes + sizeof(Version*) - 1) / sizeof(Version*) * sizeof(Version*)
+          + sizeof(_Atomic(Version*)) * lines;
+    #endif
+    return bytes;
+}
+
+/** Allocate a zeroed segment and lay it out as [header][data][shadow][control]([valid]),
+ * or as [header] then blocks of [data][shadow][control]([valid]) (see interleaved_block).
+ * The memory comes from the segment pool when it serves that size, and is mapped otherwise.
+ * @param size   Size of the segment (in bytes)
+ * @param align  Alignment of the allocation
+ * @param stripe Bytes covered by a control word (see Region)
+ * @param layout TM_LAYOUT_*
+ * @return New segment, NULL on failure
+**/
+static inline Segment* Segment_alloc(size_t size, size_t align, size_t stripe, int layout) {
+    Segment* seg;
+    size_t mapped = 0;
+    size_t bytes = Segment_bytes(size, align, layout);
+    int class = pool_class_of(bytes, align);
+    if (class != POOL_NONE) {
+        seg = (Segment*)pool_get(class, desc_mags());
+        if (unlikely(seg == NULL))
+            return NULL;
+    } else if (align <= MAP_ALIGN) {
+        // fresh pages are already zeroed, and only touched once used
+        seg = (Segment*)pool_map(bytes, &mapped);
+        if (unlikely(seg == NULL))
+            return NULL;
+    } else if (unlikely(posix_memalign((void**)&seg, align, bytes) != 0)) {
+        return NULL;
+    }
+    if (mapped == 0)
+        memset(seg, 0, bytes);
+    seg -> pool_class = class;
+    seg -> mapped = mapped;
+    seg -> size = size;
+    seg -> stripe_shift = (size_t)__builtin_ctzl(stripe);
+    #ifdef _TO_USE_MVCC_
+    size_t lines = (size + line_bytes(align) - 1) / line_bytes(align);
+    seg -> versions = (_Atomic(Version*)*)((uintptr_t)seg + bytes - sizeof(_Atomic(Version*)) * lines);
+    seg -> mv_shift = (size_t)__builtin_ctzl(line_bytes(align));
+    #endif
+
+    if (layout == TM_LAYOUT_INTERLEAVED) {
+        size_t line;
+        seg -> block = interleaved_block(align, &line);
+        seg -> line_shift = (size_t)__builtin_ctzl(line);
+        seg -> data = (Word*)((uintptr_t)seg + (sizeof(Segment) + line - 1) / line * line);
+        return seg;
+    }
+
+    seg -> data    =  (Word*)((uintptr_t)seg + sizeof(Segment));
+    seg -> shadow  =  (Word*)((uintptr_t)seg -> data + sizeof(Word) * size);
+    seg -> control =  (atomic_ulong*)((uintptr_t)seg -> shadow + sizeof(Word) * size);
+    #ifdef _TO_USE_DUAL_COPY_
+    seg -> valid   = (uint8_t*)((uintptr_t)seg -> control + sizeof(atomic_ulong) * (size / align));
+    #endif
+    return seg;
+}
+
+/** First byte of the block holding the given offset, in an interleaved segment.
+**/
+static inline Word* seg_block(const Segment* seg, size_t offset) {
+    return seg -> data + (offset >> seg -> line_shift) * seg -> block;
+}
+
+/** Offset of a byte in the line of data of its block, in an interleaved segment.
+**/
+static inline size_t seg_in_line(const Segment* seg, size_t offset) {
+    return offset & (((size_t)1 << seg -> line_shift) - 1);
+}
+
+/** Data copy of the byte at the given offset.
+ * @param seg    Segment of the byte
+ * @param offset Offset of the byte in the segment
+ * @return Data copy
+**/
+static inline Word* word_data(const Segment* seg, size_t offset) {
+    if (likely(seg -> block == 0))
+        return seg -> data + offset;
+    return seg_block(seg, offset) + seg_in_line(seg, offset);
+}
+
+/** Shadow copy of the byte at the given offset.
+ * @param seg    Segment of the byte
+ * @param offset Offset of the byte in the segment
+ * @return Shadow copy
+**/
+static inline Word* word_shadow(const Segment* seg, size_t offset) {
+    if (likely(seg -> block == 0))
+        return seg -> shadow + offset;
+    return word_data(seg, offset) + ((size_t)1 << seg -> line_shift);
+}
+
+/** Number of bytes from offset on that are contiguous in the data (and shadow) copy.
+ * @param seg    Segment
+ * @param offset Offset of the first byte
+ * @param size   Number of bytes wanted
+ * @return At most size
+**/
+static inline size_t seg_run(const Segment* seg, size_t offset, size_t size) {
+    if (likely(seg -> block == 0))
+        return size;
+    size_t left = ((size_t)1 << seg -> line_shift) - seg_in_line(seg, offset);
+    return left < size ? left : size;
+}
+
+static inline size_t seg_stripe(const Segment* seg) {
+    return (size_t)1 << seg -> stripe_shift;
+}
 
-    if ((Word*)(region -> start -> data) <= (Word*)source
-            && (Word*)source < (Word*)region -> start -> shadow)
-        // && (Word*)source < (Word*)region -> ((Word*)(start -> data)) 
-        //                                            + region -> start -> size)
-        {
-            return region -> start; 
+/** Offset of the first byte of the stripe holding the given offset.
+**/
+static inline size_t stripe_start(const Segment* seg, size_t offset) {
+    return offset >> seg -> stripe_shift << seg -> stripe_shift;
+}
+
+/** Control word of the word at the given offset, shared by the words of its stripe: the
+ * control array keeps one entry per word, only the first one of each stripe is used.
+ * @param seg    Segment of the word
+ * @param offset Offset of the word in the segment
+ * @param align  Size of a word
+ * @return Control word
+**/
+static inline atomic_ulong* word_control(const Segment* seg, size_t offset, size_t align) {
+    if (likely(seg -> block == 0))
+        return seg -> control + stripe_start(seg, offset) / align;
+    Word* controls = seg_block(seg, offset) + 2 * ((size_t)1 << seg -> line_shift);
+    return (atomic_ulong*)controls + stripe_start(seg, seg_in_line(seg, offset)) / align;
+}
+
+#ifdef _TO_USE_DUAL_COPY_
+/** Byte telling which copy of the word at the given offset is readable.
+ * @param seg    Segment of the word
+ * @param offset Offset of the word in the segment
+ * @param align  Size of a word
+ * @return Valid byte
+**/
+static inline uint8_t* word_valid(const Segment* seg, size_t offset, size_t align) {
+    if (likely(seg -> block == 0))
+        return seg -> valid + offset;
+    size_t words = ((size_t)1 << seg -> line_shift) / align;
+    Word* controls = seg_block(seg, offset) + 2 * ((size_t)1 << seg -> line_shift);
+    return (uint8_t*)((atomic_ulong*)controls + words) + seg_in_line(seg, offset) / align;
+}
+#endif
+
+/// @brief what happened to a control word we tried to take
+enum Ctl_result {
+    ctl_taken,      // newly read-marked or locked, to be logged
+    ctl_upgraded,   // locked, it was read-marked by us alone
+    ctl_held,       // we already had it
+    ctl_conflict    // locked by another writer (or read by others, for a lock)
+};
+
+/** Read-mark a word. Readers never conflict with each other: the first one leaves its id,
+ * so that it can lock the word later on, the next ones only count.
+ * @param control Control word
+ * @param id      Writer id of the transaction
+ * @return ctl_taken, ctl_held or ctl_conflict
+**/
+static inline enum Ctl_result ctl_read_mark(atomic_ulong* control, tx_t id) {
+    ulong ctl = atomic_load(control);
+    while (true) {
+        ulong next;
+        switch (ctl_tag(ctl)) {
+        case CTL_WRITE:
+            return ctl_val(ctl) == id ? ctl_held : ctl_conflict;
+        case CTL_READ_ONE:
+            if (ctl_val(ctl) == id)
+                return ctl_held;
+            next = CTL_READ_MANY | 2;
+            break;
+        case CTL_READ_MANY:
+            next = ctl + 1;
+            break;
+        default:
+            next = CTL_READ_ONE | id;
+            break;
         }
+        if (atomic_compare_exchange_weak(control, &ctl, next))
+            return ctl_taken;
+    }
+}
 
-    Segment* seg = region -> allocs;
-    while(seg != NULL) {
-            #ifdef _DEBUG_FLZ_TEST_FIND_
-            printf("Segment -> data: %p\n", seg -> data); 
-            #endif
+/** Drop a read mark taken by ctl_read_mark.
+ * @param control Control word
+ * @param id      Writer id of the transaction
+**/
+static inline void ctl_read_unmark(atomic_ulong* control, tx_t id) {
+    ulong ctl = atomic_load(control);
+    while (true) {
+        ulong next;
+        if (ctl == (CTL_READ_ONE | id) || ctl == (CTL_READ_MANY | 1))
+            next = it_is_free;
+        else if (ctl_tag(ctl) == CTL_READ_MANY)
+            next = ctl - 1;
+        else
+            return;
+        if (atomic_compare_exchange_weak(control, &ctl, next))
+            return;
+    }
+}
+
+/** Lock a word for writing, it must be free or read-marked by us alone.
+ * @param control Control word
+ * @param id      Writer id of the transaction
+ * @return ctl_taken, ctl_upgraded, ctl_held or ctl_conflict
+**/
+static inline enum Ctl_result ctl_write_lock(atomic_ulong* control, tx_t id) {
+    ulong expected = it_is_free;
+    if (atomic_compare_exchange_strong(control, &expected, CTL_WRITE | id))
+        return ctl_taken;
+    if (expected == (CTL_READ_ONE | id)
+        && atomic_compare_exchange_strong(control, &expected, CTL_WRITE | id))
+        return ctl_upgraded;
+    return expected == (CTL_WRITE | id) ? ctl_held : ctl_conflict;
+}
+
+/** Transaction with the given writer id in the current epoch.
+ * @return It, as tm_begin returned it, invalid_tx if nobody has the id
+**/
+static inline tx_t epoch_owner(Batcher* batcher, ulong id) {
+    if (id == 0 || id > epoch_size_max)
+        return invalid_tx;
+    TxDesc* owner = atomic_load_explicit(&(batcher -> owners[id]), memory_order_acquire);
+    return owner != NULL ? (tx_t)owner : invalid_tx;
+}
+
+/** Transaction holding a control word, for tm_last_abort.
+ * @return It, invalid_tx if the word is free or read by several transactions
+**/
+static inline tx_t ctl_owner(Batcher* batcher, ulong ctl) {
+    if (ctl_tag(ctl) != CTL_WRITE && ctl_tag(ctl) != CTL_READ_ONE)
+        return invalid_tx;
+    return epoch_owner(batcher, ctl_val(ctl));
+}
+
+/** Give the memory of a segment back, to the pool if it came from there.
+ * @param seg Segment to free
+**/
+static inline void Segment_free(Segment* seg) {
+    if (seg -> mapped != 0)
+        pool_unmap(seg, seg -> mapped);
+    else if (seg -> pool_class == POOL_NONE)
+        free(seg);
+    else
+        pool_put(seg -> pool_class, desc_mags(), seg);
+}
 
-        if ((Word* )seg -> data <= (Word*)source 
-             && (Word*)source < (Word*)seg -> shadow)
-        {
-            return seg;
+/** Copy of the word at the given offset that committed reads see.
+ * @param seg    Segment of the word
+ * @param offset Offset of the word in the segment
+ * @return Readable copy
+**/
+static inline Word* word_readable(const Segment* seg, size_t offset, size_t align) {
+    #ifdef _TO_USE_DUAL_COPY_
+    return *word_valid(seg, offset, align) ? word_shadow(seg, offset) : word_data(seg, offset);
+    #else
+    (void)align;
+    return word_data(seg, offset);
+    #endif
+}
+
+/** Copy of the word at the given offset that its owner writes to (and reads back).
+ * @param seg    Segment of the word
+ * @param offset Offset of the word in the segment
+ * @return Writable copy
+**/
+static inline Word* word_writable(const Segment* seg, size_t offset, size_t align) {
+    #ifdef _TO_USE_DUAL_COPY_
+    return *word_valid(seg, offset, align) ? word_data(seg, offset) : word_shadow(seg, offset);
+    #else
+    (void)align;
+    return word_shadow(seg, offset);
+    #endif
+}
+
+/** Copy committed words out of a segment, for read-only transactions.
+ * @param seg    Segment to read from
+ * @param offset Offset of the first word
+ * @param size   Number of bytes, a multiple of step
+ * @param target Private buffer
+ * @param step   Size of a word (the alignment of the region)
+**/
+static inline void read_committed(const Segment* seg, size_t offset, size_t size, void* target, size_t step) {
+    #ifdef _TO_USE_DUAL_COPY_
+    for (size_t i = 0; i < size; i += step)
+        memcpy((Word*)target + i, word_readable(seg, offset + i, step), sizeof(Word) * step);
+    #else
+    (void)step;
+    for (size_t done = 0; done < size; ) {
+        size_t run = seg_run(seg, offset + done, size - done);
+        memcpy((Word*)target + done, word_data(seg, offset + done), run);
+        done += run;
+    }
+    #endif
+}
+
+/** Read back words that the transaction all locked, as a few copies instead of one per word.
+ * @param seg    Segment to read from
+ * @param offset Offset of the first word
+ * @param size   Number of bytes, a multiple of step
+ * @param target Private buffer
+ * @param id     Id of the transaction
+ * @param step   Size of a word (the alignment of the region)
+ * @return Whether every word was locked by the transaction (nothing is copied otherwise)
+**/
+static inline bool read_own(const Segment* seg, size_t offset, size_t size, void* target, tx_t id, size_t step) {
+    #ifdef _TO_USE_DUAL_COPY_
+    // the writable copy may differ from one word to the next
+    (void)seg; (void)offset; (void)size; (void)target; (void)id; (void)step;
+    return false;
+    #else
+    // cheap way out for the usual read of words we did not write
+    if (atomic_load(word_control(seg, offset, step)) != (CTL_WRITE | id))
+        return false;
+    size_t stripe = seg_stripe(seg);
+    for (size_t done = 0; done < size; ) {
+        size_t run = seg_run(seg, offset + done, size - done);
+        if (stripe == step) {
+            // other members of the epoch may CAS these words meanwhile
+            atomic_ulong* control = word_control(seg, offset + done, step);
+            size_t owned = 0;
+            for (size_t i = 0; i < run / step; ++i)
+                owned += atomic_load_explicit(control + i, memory_order_relaxed) == (CTL_WRITE | id);
+            if (owned != run / step)
+                return false;
+        } else {
+            // only the first control word of each stripe is used
+            for (size_t i = stripe_start(seg, offset + done); i < offset + done + run; i += stripe) {
+                if (atomic_load(word_control(seg, i, step)) != (CTL_WRITE | id))
+                    return false;
+            }
         }
-        seg = seg -> next;
+        done += run;
+    }
+    // the words are ours, nobody else can change them or their control word now
+    for (size_t done = 0; done < size; ) {
+        size_t run = seg_run(seg, offset + done, size - done);
+        memcpy((Word*)target + done, word_shadow(seg, offset + done), run);
+        done += run;
     }
+    return true;
+    #endif
+}
 
-    return NULL;
+/** Copy words of one stripe to a private buffer.
+ * @param seg    Segment to read from
+ * @param offset Offset of the first word
+ * @param size   Number of bytes, within the stripe
+ * @param target Private buffer
+ * @param own    Whether the transaction locked the stripe (read the writable copy then)
+ * @param step   Size of a word (the alignment of the region)
+**/
+static inline void stripe_read(const Segment* seg, size_t offset, size_t size, void* target, bool own, size_t step) {
+    #ifdef _TO_USE_DUAL_COPY_
+    for (size_t i = 0; i < size; i += step)
+        memcpy((Word*)target + i, own ? word_writable(seg, offset + i, step) : word_readable(seg, offset + i, step), sizeof(Word) * step);
+    #else
+    // a stripe never crosses a line, it is contiguous in both layouts
+    (void)step;
+    memcpy(target, own ? word_shadow(seg, offset) : word_data(seg, offset), sizeof(Word) * size);
+    #endif
 }
 
-static inline void Undo_seg(Segment* segment, const tx_t tx, const size_t step) {
-        #ifdef _DEBUG_FLZ_TEST_UNDO_
-        printf("Undoing segment %p\n", segment);
-        #endif
-    if (atomic_load(&(segment -> to_delete)) )
-        return;
-    if (atomic_load(&(segment -> creator)) == tx) {
-        // tm_free(region, tx, segment); 
-        atomic_store(&(segment -> to_delete), 1); 
-        return; 
-    }
-
-    // printf("segment -> size: %lu\n", segment -> size);
-    for (size_t i = 0; i < segment -> size; i += step) {
-        char * control = segment -> control + i;
-        if (atomic_load(control) == tx) {
-
-            #ifdef _DEBUG_FLZ_TEST_UNDO_
-            printf("j: %lu\n", i/8);
-            #endif
-
-            // undo the write
-            memcpy(segment -> shadow + i, segment -> data + i, sizeof(Word) * step);
-            atomic_store(control, it_is_free);
-        } 
-        else {
-            // if we did the read
-            // char we_read_tx = tx + batch_size;
-            char we_read_tx = -tx;
-            atomic_compare_exchange_strong(control, &we_read_tx, it_is_free);
-                #ifdef _DEBUG_FLZ_TEST_UNDO_
-                if (we_read_tx == -tx){
-                    //  + batch_size) {
-                    printf("!j: %lu\n", i/8);
-                }
-                #endif
+/** Bring the writable copy of a stripe the transaction just locked up to date, since the
+ * commit makes the whole stripe readable and the transaction may only write part of it.
+ * @param seg   Segment of the stripe
+ * @param start Offset of the first byte of the stripe
+ * @param step  Size of a word (the alignment of the region)
+**/
+static inline void stripe_fill(const Segment* seg, size_t start, size_t step) {
+    size_t size = seg_stripe(seg);
+    if (start + size > seg -> size)
+        size = seg -> size - start;
+    #ifdef _TO_USE_DUAL_COPY_
+    for (size_t i = 0; i < size; i += step)
+        memcpy(word_writable(seg, start + i, step), word_readable(seg, start + i, step), sizeof(Word) * step);
+    #else
+    (void)step;
+    memcpy(word_shadow(seg, start), word_data(seg, start), sizeof(Word) * size);
+    #endif
+}
+
+static inline Segment* findSegment(const Region * region, const void* source) {
+    log_trace("findSegment: %p", source);
+
+    uintptr_t id = (uintptr_t)source >> SEG_SHIFT;
+    if (unlikely(id >= SEG_MAX))
+        return NULL;
+
+    _Atomic(Segment*)* page = atomic_load(&(region -> index[id >> SEG_PAGE_SHIFT]));
+    if (unlikely(page == NULL))
+        return NULL;
+    Segment* seg = atomic_load(page + (id & (SEG_PAGE - 1)));
+    if (unlikely(seg == NULL || seg == SEG_TOMBSTONE || seg_offset(source) >= seg -> size))
+        return NULL;
+
+    return seg;
+}
+
+// ==============================
+// Epoch sizing
+
+/** Take the turn of the batcher, counting the wait toward the statistics of the thread.
+ * @param batcher Batcher of the region
+ * @param desc    Descriptor of the thread
+**/
+static inline void turn_take(Batcher* batcher, TxDesc* desc) {
+    ulong traced = trace_clock();
+    #ifdef _TO_USE_STATS_
+    ulong start = now_ns();
+    ticket_take(batcher, &(desc -> queue));
+    desc_stat(desc, tickets, 1);
+    desc_stat(desc, ticket_ns, now_ns() - start);
+    #else
+    ticket_take(batcher, &(desc -> queue));
+    #endif
+    trace_add(desc, trace_ticket, traced, 0);
+}
+
+/** Exponentially weighted moving average (3/4 old, 1/4 new).
+**/
+static inline void ewma_update(atomic_ulong* avg, ulong sample) {
+    atomic_store(avg, (3 * atomic_load(avg) + sample) / 4);
+}
+
+/** Pick the number of writers to admit in the next epoch from what the one that just ended
+ * looked like. Halve it when writers keep aborting each other, grow it with the number of
+ * writers left waiting as long as aborts stay rare and committing does not dominate the epoch.
+ * Only called by the last thread out of a writing epoch.
+ * @param batcher   Batcher of the region
+ * @param commit_ns Time spent in Commit for this epoch
+**/
+static inline void epoch_resize(Batcher* batcher, ulong commit_ns) {
+    ulong size     = atomic_load(&(batcher -> epoch_size));
+    ulong admitted = size - atomic_load(&(batcher -> res_writes));
+    ulong aborts   = atomic_load(&(batcher -> epoch_aborts));
+    ulong waiting  = atomic_load(&(batcher -> epoch_waiting));
+    ulong end      = now_ns();
+
+    if (admitted != 0)
+        ewma_update(&(batcher -> avg_abort_permille), aborts * 1000 / admitted);
+    ewma_update(&(batcher -> avg_commit_ns), commit_ns);
+    ewma_update(&(batcher -> avg_epoch_ns), end - batcher -> epoch_start_ns);
+
+    ulong abort_permille = atomic_load(&(batcher -> avg_abort_permille));
+    if (abort_permille > 300) {
+        size = size / 2;
+    } else if (waiting != 0 && abort_permille < 100
+               && 2 * atomic_load(&(batcher -> avg_commit_ns)) < atomic_load(&(batcher -> avg_epoch_ns))) {
+        size = size + (waiting + 1) / 2;
+    }
+    size = size < epoch_size_min ? epoch_size_min : size;
+    size = size > epoch_size_max ? epoch_size_max : size;
+
+    atomic_store(&(batcher -> epoch_size), size);
+    atomic_store(&(batcher -> res_writes), size);
+    atomic_store(&(batcher -> epoch_aborts), 0);
+    atomic_store(&(batcher -> epoch_waiting), 0);
+    batcher -> epoch_start_ns = end;
+}
+
+// ==============================
+// Read-only snapshots
+
+/** Start a read-only transaction on the committed state, without taking a ticket.
+ * Only waits if an epoch is being committed right now.
+ * @param batcher Batcher of the region
+ * @param desc    Descriptor of the transaction
+**/
+static inline void snapshot_begin(Batcher* batcher, TxDesc* desc) {
+    ulong seq = atomic_load(&(batcher -> commit_seq));
+    #ifdef _TO_USE_MVCC_
+    // the state before a running commit is still readable, see mvcc_read
+    desc -> ro_snapshot = seq & ~1ul;
+    #else
+    for (int spin = 0; seq & 1; ++spin) {
+        if (spin < WAIT_SPIN)
+            cpu_relax();
+        else
+            sched_yield();
+        seq = atomic_load(&(batcher -> commit_seq));
+    }
+    desc -> ro_snapshot = seq;
+    #endif
+}
+
+/** Whether nothing was committed since the snapshot, i.e. the reads so far are consistent.
+ * @param batcher Batcher of the region
+ * @param desc    Descriptor of the transaction
+**/
+static inline bool snapshot_valid(Batcher* batcher, const TxDesc* desc) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&(batcher -> commit_seq), memory_order_relaxed) == desc -> ro_snapshot;
+}
+
+static inline void snapshot_end(Batcher* batcher, TxDesc* desc, bool committed) {
+    (void)batcher;
+    desc_done(desc, committed);
+}
+
+/** Make commit_seq odd (or even again) around the writes of a commit.
+ * @param batcher Batcher of the region
+**/
+static inline void commit_seq_bump(Batcher* batcher) {
+    atomic_fetch_add(&(batcher -> commit_seq), 1);
+}
+
+// ==============================
+// Transaction footprint (kept in the descriptor, see desc_func.h)
+
+/** Make room for one more entry in the footprint, so that the push after acquiring a word cannot fail.
+ * @param log Footprint to grow
+ * @return Whether there is room for one more entry
+**/
+static inline bool txlog_reserve(TxLog* log) {
+    if (likely(log -> size < log -> capacity))
+        return true;
+    size_t capacity = log -> capacity ? log -> capacity * 2 : 64;
+    Access* entries = (Access*)realloc(log -> entries, capacity * sizeof(Access));
+    if (unlikely(!entries))
+        return false;
+    log -> entries = entries;
+    log -> capacity = capacity;
+    return true;
+}
+
+/** Record an access, there must be room for it (see txlog_reserve).
+ * @param log    Footprint to append to
+ * @param seg    Segment accessed
+ * @param offset Offset of the word in the segment
+ * @param kind   What was done
+**/
+static inline void txlog_push(TxLog* log, Segment* seg, size_t offset, enum Access_kind kind) {
+    Access* access = log -> entries + log -> size++;
+    access -> seg = seg;
+    access -> offset = offset;
+    access -> words = 1;
+    access -> kind = kind;
+}
+
+/** Record an access to a stripe, merged into the last entry when it is the same kind of access
+ * to the next stripe of the same segment, so that a range is committed or rolled back as a run.
+ * There must be room for one more entry (see txlog_reserve).
+ * @param log    Footprint to append to
+ * @param seg    Segment accessed
+ * @param offset Offset of the first byte of the stripe in the segment
+ * @param kind   What was done, a read, write or upgrade
+**/
+static inline void txlog_push_word(TxLog* log, Segment* seg, size_t offset, enum Access_kind kind) {
+    if (log -> size > 0) {
+        Access* last = log -> entries + log -> size - 1;
+        if (last -> seg == seg && last -> kind == kind && last -> offset + last -> words * seg_stripe(seg) == offset) {
+            ++(last -> words);
+            return;
+        }
+    }
+    txlog_push(log, seg, offset, kind);
+}
+
+static inline void txlog_clear(TxLog* log) {
+    log -> size = 0;
+}
+
+static inline void epoch_leave(Region* region, TxDesc* desc);
+static inline bool cm_resolve(Region* region, TxDesc* desc, atomic_ulong* control);
+static inline void cm_worked(TxDesc* desc, size_t words);
+static inline void heat_note(Region* region, TxDesc* desc, const Segment* seg, size_t start, tx_t owner);
+#ifdef _TO_USE_MVCC_
+static inline void mvcc_capture(Region* region, TxLog* logs);
+static inline void mvcc_detach(Segment* seg);
+#endif
+
+/** Take a segment out of the index and keep its memory until no running transaction
+ * can hold a pointer to it. The caller owns region -> limbo (the committing thread for
+ * the batcher, region -> lock for TL2).
+ * @param region Shared memory region
+ * @param seg    Segment, already out of region -> allocs (see seglist_sweep)
+**/
+static inline void limbo_retire(Region* region, Segment* seg) {
+    index_retire(region, seg);
+    seg -> retired = ebr_retire();
+    seg -> retired_next = region -> limbo;
+    region -> limbo = seg;
+}
+
+/** Add a segment to region -> allocs, any number of threads may push at once.
+ * @param region Shared memory region
+ * @param seg    Segment, already in the index
+**/
+static inline void seglist_push(Region* region, Segment* seg) {
+    Segment* head = atomic_load(&(region -> allocs));
+    do {
+        atomic_store_explicit(&(seg -> next), head, memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak(&(region -> allocs), &head, seg));
+}
+
+/** Unlink the dead segments from region -> allocs and retire them. Pushes only touch the
+ * head and there is one sweeper at a time (the owner of region -> limbo), so an interior
+ * link is fixed with a plain store. An unlinked segment keeps its next pointer, a thread
+ * walking the list from it carries on, and its memory outlives the walk (see limbo_release).
+ * @param region Shared memory region
+**/
+static inline void seglist_sweep(Region* region) {
+    Segment* prev = NULL;
+    Segment* seg = atomic_load(&(region -> allocs));
+    while (seg != NULL) {
+        Segment* next = atomic_load(&(seg -> next));
+        if (!atomic_load(&(seg -> dead))) {
+            prev = seg;
+            seg = next;
+            continue;
+        }
+        Segment* expected = seg;
+        if (prev != NULL) {
+            atomic_store(&(prev -> next), next);
+        } else if (!atomic_compare_exchange_strong(&(region -> allocs), &expected, next)) {
+            // pushed in front meanwhile, the new segments lead to seg
+            prev = expected;
+            while (atomic_load(&(prev -> next)) != seg)
+                prev = atomic_load(&(prev -> next));
+            atomic_store(&(prev -> next), next);
         }
+        limbo_retire(region, seg);
+        seg = next;
     }
 }
 
-static inline void Undo(Region * region, const tx_t tx) {
-        #ifdef _DEBUG_FLZ_TEST_UNDO_
-        printf("Undoing %lu\n", tx);
-        // printf("Undoing %lu\n", tx + batch_size);
-        printf("Undoing %lu\n", -tx );
+/** Reclaim the segments of the limbo that no running transaction can reference any more,
+ * and hand their addresses out again. The caller owns region -> limbo.
+ * @param region Shared memory region
+**/
+static inline void limbo_release(Region* region) {
+    if (region -> limbo == NULL)
+        return;
+    ulong horizon = ebr_horizon();
+    // stamps decrease along the limbo, cut it at the first segment old enough
+    Segment** link = &(region -> limbo);
+    while (*link != NULL && (*link) -> retired >= horizon)
+        link = &((*link) -> retired_next);
+    Segment* seg = *link;
+    *link = NULL;
+    while (seg != NULL) {
+        Segment* next = seg -> retired_next;
+        index_remove(region, seg);
+        #ifdef _TO_USE_MVCC_
+        mvcc_detach(seg);
         #endif
+        Segment_free(seg);
+        seg = next;
+    }
+}
 
+static inline void Undo_access(const Access* access, const tx_t tx, const size_t step) {
+    Segment* segment = access -> seg;
+    size_t first = access -> offset;
+    size_t stripe = seg_stripe(segment);
+    size_t last = first + access -> words * stripe;
 
-    Undo_seg(region -> start, tx, region -> align);
-    for (Segment* segment = region -> allocs; segment != NULL; segment = segment -> next) {
-        Undo_seg(segment, tx, region -> align);
+    switch (access -> kind) {
+    case access_write:
+        // undo the write: the writable copy of a word is only read by its owner,
+        // and only made readable at commit if it is in a footprint,
+        // so releasing the words is enough (one at a time, other threads may be
+        // trying to take them)
+        for (size_t i = first; i < last; i += stripe)
+            atomic_store(word_control(segment, i, step), it_is_free);
+        break;
+    case access_upgrade:
+        // the words go back to being read-marked by us, the read entries come next
+        for (size_t i = first; i < last; i += stripe)
+            atomic_store(word_control(segment, i, step), CTL_READ_ONE | tx);
+        break;
+    case access_read:
+        // release the read marks, other readers may hold the words too
+        for (size_t i = first; i < last; i += stripe)
+            ctl_read_unmark(word_control(segment, i, step), tx);
+        break;
+    case access_alloc:
+        log_debug("Undo: dropping segment %p", (void*)segment);
+        // nobody else can reach it, drop it with the epoch
+        atomic_store(&(segment -> to_delete), 1); 
+        break;
+    case access_free:
+        // give the segment back
+        atomic_store(&(segment -> to_delete), 0); 
+        atomic_store(&(segment -> creator), it_is_free); 
+        break;
+    case access_drop:
+        // left by an earlier roll back, not part of a footprint being undone
+        break;
     }
-    tm_end((void*)region, tx);
 }
 
-static inline void Commit_seg(Region* region, Segment* seg) {
-    if (atomic_load(&(seg -> to_delete))){
-            #ifdef _DEBUG_FLZ_TEST_UNDO_
-            printf("Undoing segment %p\n", seg);
-            #endif
+/** Roll back a transaction, walking only what it touched, then leave the epoch.
+ * @param region Shared memory region
+ * @param desc   Descriptor of the transaction to roll back
+**/
+static inline void Undo(Region * region, TxDesc* desc) {
+    const tx_t tx = desc -> id;
+    TxLog* log = &(desc -> log);
+    log_debug("Undo: writer %lu rolls back %zu accesses", (ulong)tx, log -> size);
 
-        // tm_free(region, seg -> creator, seg); 
-        // remove from linked list
-        if (seg -> previous) 
-            seg -> previous -> next = seg -> next;
-        else 
-            region -> allocs = seg -> next;
-        if (seg -> next) 
-            seg -> next -> previous = seg -> previous;
+    for (size_t n = log -> size; n-- > 0; ) {
+        Undo_access(log -> entries + n, tx, region -> align);
+    }
 
-        // print("freeing segment %x\n", seg);
-        // free(seg -> data);
-        free(seg);
-        return; 
+    // only the segments we created are left for the end of the epoch
+    size_t kept = 0;
+    for (size_t n = 0; n < log -> size; ++n) {
+        if (log -> entries[n].kind == access_alloc) {
+            log -> entries[kept] = log -> entries[n];
+            log -> entries[kept].kind = access_drop;
+            ++kept;
+        }
     }
-    // commit all writes
-    // from shadow to data
+    log -> size = kept;
 
+    atomic_fetch_add_explicit(&(region -> batcher -> epoch_aborts), 1, memory_order_relaxed);
+    epoch_leave(region, desc);
+    desc_done(desc, false);
+}
 
-        // #ifdef _DEBUG_FLZ_
-        // printf("\n\nsegment address: %p\n", seg);
-        // printf("size(Segment Header): %lu\n", sizeof(Segment));
-        // printf("segment -> size: %lu\n", seg -> size);
-        // printf("size(Word): %lu\n", sizeof(Word));
-        // printf("Commiting %p -> %p\n", seg->shadow, seg -> data);
-        // #endif
+/** Hand the footprint of an ending transaction to the batcher, before leaving the epoch.
+ * @param batcher Batcher of the region
+ * @param log     Footprint, must stay untouched until the epoch ends
+**/
+static inline void txlog_publish(Batcher* batcher, TxLog* log) {
+    if (log -> size == 0)
+        return;
+    log -> next = atomic_load(&(batcher -> logs));
+    while (!atomic_compare_exchange_weak(&(batcher -> logs), &(log -> next), log));
+}
 
+static inline void Delete_seg(Segment* seg) {
+    log_debug("Commit: deleting segment %p", (void*)seg);
 
-    memcpy(seg -> data, seg -> shadow, seg -> size * sizeof(Word));
-    // and reset control
-    memset(seg -> control, 0, seg -> size * sizeof(char));
-    // and it will not get reset in the following epoches
-    atomic_store(&(seg -> creator), it_is_free); 
+    // unlinked by the sweep at the end of Commit, a read-only transaction
+    // may still be copying from it after that
+    atomic_store(&(seg -> dead), true);
 }
 
-static inline bool try_write(Region * region, Segment* seg, tx_t tx, void* target, const size_t size) {
-    ulong offset = ((uintptr_t)target - (uintptr_t)seg -> data)/sizeof(Word);
+/** Apply and release one entry of a footprint.
+ * @return Bytes of data applied
+**/
+static inline size_t Commit_access(const Access* access, const size_t step) {
+    Segment* seg = access -> seg;
+    size_t offset = access -> offset;
+    size_t size = access -> words * seg_stripe(seg);
+    // the last stripe may end past the segment
+    if (offset + size > seg -> size)
+        size = seg -> size - offset;
+
+    switch (access -> kind) {
+    case access_write:
+    case access_upgrade:
+        #ifdef _TO_USE_DUAL_COPY_
+        // the written copy becomes the readable one, nothing to move
+        for (size_t i = offset; i < offset + size; i += step)
+            *word_valid(seg, i, step) ^= 1;
+        #else
+        // from shadow to data
+        for (size_t done = 0; done < size; ) {
+            size_t run = seg_run(seg, offset + done, size - done);
+            memcpy(word_data(seg, offset + done), word_shadow(seg, offset + done), sizeof(Word) * run);
+            done += run;
+        }
+        #endif
+        // fall through
+    case access_read:
+        // the control words of a line are contiguous, release them in bulk
+        for (size_t done = 0; done < size; ) {
+            size_t run = seg_run(seg, offset + done, size - done);
+            ctl_clear(word_control(seg, offset + done, step), run / step);
+            done += run;
+        }
+        return access -> kind == access_read ? 0 : size;
+    case access_alloc:
+        // and it will not get reset in the following epoches
+        atomic_store(&(seg -> creator), it_is_free); 
+        break;
+    case access_free:
+    case access_drop:
+        // after all the writes, see Commit
+        break;
+    }
+    return 0;
+}
+
+/** Commit the epoch: apply and release the footprints handed to the batcher, so the cost is
+ * proportional to what was touched in this epoch rather than to the size of the region.
+ * Only called by the last thread out of the epoch.
+ * @param region Shared memory region
+ * @param desc   Descriptor of that thread, for the statistics
+**/
+static inline void Commit(Region* region, TxDesc* desc) {
+    TxLog* logs = atomic_exchange(&(region -> batcher -> logs), NULL);
+
+    limbo_release(region);
+
+    #ifdef _TO_USE_MVCC_
+    mvcc_capture(region, logs);
+    #endif
+
+    size_t bytes = 0;
+    for (TxLog* log = logs; log != NULL; log = log -> next) {
+        for (size_t n = 0; n < log -> size; ++n) {
+            bytes += Commit_access(log -> entries + n, region -> align);
+            desc_stat(desc, seg_allocs, log -> entries[n].kind == access_alloc);
+        }
+    }
+    desc_stat(desc, commit_bytes, bytes);
+
+    // segments go away last, someone may have written to one before it got freed
+    bool deleted = false;
+    for (TxLog* log = logs; log != NULL; log = log -> next) {
+        for (size_t n = 0; n < log -> size; ++n) {
+            enum Access_kind kind = log -> entries[n].kind;
+            if (kind == access_free || kind == access_drop) {
+                Delete_seg(log -> entries[n].seg);
+                // a dropped allocation never got committed
+                desc_stat(desc, seg_frees, kind == access_free);
+                deleted = true;
+            }
+        }
+    }
+    if (deleted)
+        seglist_sweep(region);
+}
+
+static inline bool try_write(Region * region, Segment* seg, TxDesc* desc, void* target, const size_t size) {
+    const tx_t tx = desc -> id;
+    ulong offset = seg_offset(target)/sizeof(Word);
+    cm_worked(desc, size / region -> align);
 
         // #ifdef _DEBUG_FLZ_TEST_UNDO_
         // printf("\ncurrent tx: %lu\n", tx);
@@ -158,22 +1003,40 @@ static inline bool try_write(Region * region, Segment* seg, tx_t tx, void* targe
         // #endif
 
     size_t step = region -> align; 
-    for (size_t i = 0; i < size; i += step) {
-        char * control = seg -> control + offset + i;
-        char expected1 = it_is_free, expected2 = -tx;
-        //  + batch_size;
-
-        if (!(atomic_compare_exchange_strong(control, &expected1, tx) 
-            || expected1 == tx 
-            || atomic_compare_exchange_strong(control, &expected2, tx)))
-        {
-          if (i > 1)
-          {
-            bzero(seg -> control + offset, (i - 1) * sizeof(char));
-          }
-
-          // Someone else has already locked the word
-          return false;
+    size_t stripe = seg_stripe(seg);
+    for (size_t start = stripe_start(seg, offset); start < offset + size; start += stripe) {
+        atomic_ulong* control = word_control(seg, start, step);
+
+        if (unlikely(!txlog_reserve(&(desc -> log)))) {
+            desc_abort_why(desc, TM_ABORT_NOMEM, target, invalid_tx);
+            return false;
+        }
+
+        // the contention manager may get the owner out of the way
+        enum Ctl_result locked;
+        while ((locked = ctl_write_lock(control, tx)) == ctl_conflict
+               && cm_resolve(region, desc, control));
+        switch (locked) {
+        case ctl_taken:
+        case ctl_upgraded:
+            // newly locked, Undo will release it or give the read mark back
+            txlog_push_word(&(desc -> log), seg, start, locked == ctl_taken ? access_write : access_upgrade);
+            // the commit makes the whole stripe readable
+            if (start < offset || start + stripe > offset + size)
+                stripe_fill(seg, start, step);
+            break;
+        case ctl_held:
+            break;
+        case ctl_conflict: {
+            // Someone else has already locked or read the stripe
+            // (the stripes locked so far are in the footprint)
+            ulong ctl = atomic_load(control);
+            tx_t owner = ctl_owner(region -> batcher, ctl);
+            desc_abort_why(desc, ctl_tag(ctl) == CTL_WRITE ? TM_ABORT_WRITE_WRITE : TM_ABORT_WRITE_READ,
+                           (const uint8_t*)target + (start > offset ? start - offset : 0), owner);
+            heat_note(region, desc, seg, start, owner);
+            return false;
+        }
         }
 
     }
@@ -189,6 +1052,58 @@ static inline bool try_write(Region * region, Segment* seg, tx_t tx, void* targe
     return true;
 }
 
+/** Leave the epoch: the last thread out commits it and opens the next one, a writer waits
+ * for the commit of its epoch before returning.
+ * @param region Shared memory region
+ * @param desc   Descriptor of the transaction, not a read-only snapshot
+**/
+static inline void epoch_leave(Region* region, TxDesc* desc) {
+    Batcher *batcher = region -> batcher;
+    const tx_t tx = desc -> id;
+
+    // the last thread out commits our footprint
+    if (!is_read_only(tx))
+        txlog_publish(batcher, &(desc -> log));
+
+    QNode* node = &(desc -> queue);
+    turn_take(batcher, desc);
+
+    if (held_add(&(batcher->cnt_thread), -1) == 1) {
+        // if at the end of the epoch, do cleanup
+        if (atomic_load(&(batcher->is_writing))) {
+            // if this epoch contains some writes
+            ulong commit_start = now_ns();
+            ulong traced = trace_clock();
+            commit_seq_bump(batcher);
+            Commit(region, desc);
+            commit_seq_bump(batcher);
+            trace_add(desc, trace_commit, traced, 0);
+            if (!is_read_only(tx))
+                txlog_clear(&(desc -> log));
+            desc_stat(desc, epochs, 1);
+            desc_stat(desc, epoch_writers, atomic_load(&(batcher -> epoch_size)) - atomic_load(&(batcher -> res_writes)));
+
+            // and start a new epoch, sized after this one
+            epoch_resize(batcher, now_ns() - commit_start);
+            atomic_store(&(batcher->is_writing), false);
+
+            epoch_advance(batcher);
+            trace_add(desc, trace_epoch, 0, get_epoch(batcher));
+        }
+        ticket_pass(batcher, node);
+    } else if (is_read_only(tx)) {
+        // if read-only, no need to block
+        ticket_pass(batcher, node);
+    } else {
+        // if is writing, wait until the end of epoch (after commit) to return
+        ulong this_epoch = get_epoch(batcher);
+        ticket_pass(batcher, node);
+        epoch_wait(batcher, this_epoch);
+        // committed by the last thread
+        txlog_clear(&(desc -> log));
+    }
+}
+
 #endif
 
 #endif
\ No newline at end of file
@@ -0,0 +1,143 @@
+#ifndef _CM_H_
+#define _CM_H_
+
+// Contention manager of the batcher: what a transaction does when a stripe it
+// needs is locked or read-marked by another one (TM_CM_* in tm_ext.h).
+// Batcher locks are only released when the epoch commits, so a winner cannot
+// wait for the owner to finish: it dooms the owner, which rolls back at its
+// next call (and so releases the stripe), and waits for that. Only older (or
+// busier) transactions wait for younger ones, so waits cannot form a cycle.
+// The state of a descriptor carries the writer id of its transaction, so that
+// a kill aimed at the holder of a stripe cannot hit the next transaction the
+// same thread runs.
+// TL2 regions only back off, their locks are held by committing transactions.
+
+#include <sched.h>
+#include <stdatomic.h>
+
+#include "structs.h"
+#include "desc_func.h"
+#include "batcher_func.h"
+#include "macros.h"
+#include "tm_ext.h"
+
+/** Start (or retry) a read-write transaction: back off after an abort if the region says
+ * so, and keep the priority of the first attempt.
+ * @param region Shared memory region
+ * @param desc   Descriptor of the transaction
+**/
+static inline void cm_begin(Region* region, TxDesc* desc) {
+    if (desc -> rw_retries == 0) {
+        atomic_store_explicit(&(desc -> cm_birth), now_ns(), memory_order_relaxed);
+        atomic_store_explicit(&(desc -> cm_karma), 0, memory_order_relaxed);
+    } else if (region -> cm == TM_CM_BACKOFF) {
+        // random wait in [0, CM_BACKOFF_NS << rw_retries), xorshift
+        ulong seed = desc -> cm_seed ? desc -> cm_seed : (ulong)(uintptr_t)desc | 1;
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        desc -> cm_seed = seed;
+        ulong shift = desc -> rw_retries < CM_BACKOFF_SHIFT ? desc -> rw_retries : CM_BACKOFF_SHIFT;
+        ulong until = now_ns() + seed % (CM_BACKOFF_NS << shift);
+        while (now_ns() < until)
+            cpu_relax();
+    }
+}
+
+/** State of a transaction for the contention manager.
+ * @param id    Writer id of the transaction
+ * @param phase CM_RUNNING, CM_DOOMED or CM_DONE
+**/
+static inline ulong cm_state_of(tx_t id, ulong phase) {
+    return (ulong)id << CM_PHASE_BITS | phase;
+}
+
+/** Register the writer id a transaction got in the epoch, so that others can find it
+ * (and doom it).
+**/
+static inline void cm_register(Batcher* batcher, TxDesc* desc) {
+    atomic_store_explicit(&(desc -> cm_state), cm_state_of(desc -> id, CM_RUNNING), memory_order_relaxed);
+    atomic_store_explicit(&(batcher -> owners[desc -> id]), desc, memory_order_release);
+}
+
+/** Whether another transaction had this one roll back, see cm_resolve.
+**/
+static inline bool cm_doomed(const TxDesc* desc) {
+    ulong state = atomic_load_explicit(&(desc -> cm_state), memory_order_relaxed);
+    return unlikely((state & ((1ul << CM_PHASE_BITS) - 1)) == CM_DOOMED);
+}
+
+/** Count accessed words toward the karma of the transaction.
+**/
+static inline void cm_worked(TxDesc* desc, size_t words) {
+    // only this thread writes it
+    ulong karma = atomic_load_explicit(&(desc -> cm_karma), memory_order_relaxed);
+    atomic_store_explicit(&(desc -> cm_karma), karma + words, memory_order_relaxed);
+}
+
+/** Close a read-write transaction about to commit, it cannot be doomed any more.
+ * @return Whether it can commit (it was not doomed first)
+**/
+static inline bool cm_finish(TxDesc* desc) {
+    ulong running = cm_state_of(desc -> id, CM_RUNNING);
+    return atomic_compare_exchange_strong(&(desc -> cm_state), &running, cm_state_of(desc -> id, CM_DONE));
+}
+
+/** Whether a transaction has priority over the owner of a stripe it needs.
+**/
+static inline bool cm_wins(int cm, TxDesc* desc, TxDesc* owner) {
+    if (cm == TM_CM_KARMA) {
+        ulong mine = atomic_load_explicit(&(desc -> cm_karma), memory_order_relaxed);
+        ulong theirs = atomic_load_explicit(&(owner -> cm_karma), memory_order_relaxed);
+        if (mine != theirs)
+            return mine > theirs;
+    }
+    ulong mine = atomic_load_explicit(&(desc -> cm_birth), memory_order_relaxed);
+    ulong theirs = atomic_load_explicit(&(owner -> cm_birth), memory_order_relaxed);
+    if (mine != theirs)
+        return mine < theirs;
+    return (uintptr_t)desc < (uintptr_t)owner;
+}
+
+/** Decide what to do about a stripe held by another transaction: either have the owner
+ * roll back and wait until it released the stripe, or give up.
+ * @param region  Shared memory region
+ * @param desc    Descriptor of the transaction that hit the conflict
+ * @param control Control word of the stripe
+ * @return Whether to try the stripe again, the caller rolls back otherwise
+**/
+static inline bool cm_resolve(Region* region, TxDesc* desc, atomic_ulong* control) {
+    if (region -> cm != TM_CM_TIMESTAMP && region -> cm != TM_CM_KARMA)
+        return false;
+    ulong seen = atomic_load(control);
+    // several readers: nobody to pick
+    if (ctl_tag(seen) != CTL_WRITE && ctl_tag(seen) != CTL_READ_ONE)
+        return false;
+    ulong id = ctl_val(seen);
+    if (unlikely(id > epoch_size_max))
+        return false;
+    TxDesc* owner = atomic_load_explicit(&(region -> batcher -> owners[id]), memory_order_acquire);
+    if (owner == NULL || owner == desc || !cm_wins(region -> cm, desc, owner))
+        return false;
+
+    // owners[id] is a thread, which may have moved on to another transaction (and id):
+    // only doom the one holding the stripe
+    ulong running = cm_state_of(id, CM_RUNNING);
+    if (atomic_compare_exchange_strong(&(owner -> cm_state), &running, cm_state_of(id, CM_DOOMED)))
+        atomic_fetch_add_explicit(&(region -> batcher -> cm_kills), 1, memory_order_relaxed);
+    else if (running != cm_state_of(id, CM_DOOMED))
+        return false; // already committing, or not the holder any more
+
+    // it rolls back at its next call, unless we get doomed meanwhile
+    for (ulong spin = 0; atomic_load(control) == seen; ++spin) {
+        if (cm_doomed(desc) || spin > CM_WAIT_MAX)
+            return false;
+        if (spin < WAIT_SPIN)
+            cpu_relax();
+        else
+            sched_yield();
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,231 @@
+#ifndef _DESC_H_
+#define _DESC_H_
+
+// Transaction descriptors: one per thread, taken from a process-wide pool
+// the first time the thread begins a transaction and given back when the
+// thread exits, buffers included. tm_begin then allocates nothing.
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "structs.h"
+#include "pool_func.h"
+#include "macros.h"
+#include "tm_ext.h"
+
+#define DESC_ALIGN 64
+
+static pthread_mutex_t desc_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+/// @brief descriptors of exited threads, ready to be reused
+static TxDesc* desc_free = NULL;
+/// @brief every descriptor ever made, never freed before the library is unloaded;
+/// only ever pushed to, so it can be walked without the lock
+static _Atomic(TxDesc*) desc_all = NULL;
+
+static pthread_key_t desc_key;
+static pthread_once_t desc_key_once = PTHREAD_ONCE_INIT;
+static bool desc_key_made = false;
+
+/// @brief descriptor of this thread, NULL until its first transaction
+static _Thread_local TxDesc* desc_self = NULL;
+
+/** Give the descriptor of an exiting thread back to the pool.
+ * @param arg Descriptor
+**/
+static void desc_release(void* arg) {
+    TxDesc* desc = (TxDesc*)arg;
+    pool_flush(desc -> mags);
+    // the aborts of this thread are none of the next one's business
+    desc -> why = TM_ABORT_NONE;
+    pthread_mutex_lock(&desc_pool_lock);
+    desc -> next_free = desc_free;
+    desc_free = desc;
+    pthread_mutex_unlock(&desc_pool_lock);
+}
+
+static void desc_key_make(void) {
+    desc_key_made = pthread_key_create(&desc_key, desc_release) == 0;
+}
+
+/** Slow path of desc_get: reuse a pooled descriptor or make one.
+ * @return Descriptor of this thread, NULL if out of memory
+**/
+static TxDesc* desc_acquire(void) {
+    pthread_once(&desc_key_once, desc_key_make);
+
+    pthread_mutex_lock(&desc_pool_lock);
+    TxDesc* desc = desc_free;
+    if (desc != NULL) {
+        desc_free = desc -> next_free;
+    } else {
+        size_t bytes = (sizeof(TxDesc) + DESC_ALIGN - 1) / DESC_ALIGN * DESC_ALIGN;
+        desc = (TxDesc*)aligned_alloc(DESC_ALIGN, bytes);
+        if (likely(desc != NULL)) {
+            memset(desc, 0, bytes);
+            desc -> next_all = atomic_load(&desc_all);
+            atomic_store(&desc_all, desc);
+        }
+    }
+    pthread_mutex_unlock(&desc_pool_lock);
+
+    if (unlikely(desc == NULL))
+        return NULL;
+    if (desc_key_made)
+        pthread_setspecific(desc_key, desc);
+    desc_self = desc;
+    return desc;
+}
+
+/** Descriptor of the calling thread.
+ * @return Descriptor, NULL if out of memory
+**/
+static inline TxDesc* desc_get(void) {
+    if (likely(desc_self != NULL))
+        return desc_self;
+    return desc_acquire();
+}
+
+/** Segment pool magazines of the calling thread.
+ * @return Magazines, NULL if the thread has no descriptor (yet)
+**/
+static inline SegMag* desc_mags(void) {
+    return desc_self ? desc_self -> mags : NULL;
+}
+
+/** Blocks of a size class sitting in the magazines of all threads, for statistics.
+ * @param class Size class
+ * @return Number of blocks (racy, the threads keep running)
+**/
+static inline ulong desc_mags_cached(int class) {
+    ulong cached = 0;
+    pthread_mutex_lock(&desc_pool_lock);
+    for (TxDesc* desc = atomic_load(&desc_all); desc != NULL; desc = desc -> next_all)
+        cached += ((volatile SegMag*)(desc -> mags + class)) -> count;
+    pthread_mutex_unlock(&desc_pool_lock);
+    return cached;
+}
+
+// ==============================
+// Statistics (_TO_USE_STATS_): each thread only bumps the counters of its own
+// descriptor, with a plain load and store, so the hot path writes no line
+// another thread writes. Without the switch, desc_stat is gone, arguments
+// included.
+
+#ifdef _TO_USE_STATS_
+#define desc_stat(desc, counter, n) desc_stat_add(&((desc) -> stats.counter), (n))
+#else
+#define desc_stat(desc, counter, n) ((void)(desc), (void)sizeof(n))
+#endif
+
+static inline void desc_stat_add(atomic_ulong* counter, ulong n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/** Sum of the counters of all threads, those that exited included.
+ * @param sum Counters to fill, all 0 without _TO_USE_STATS_
+**/
+static inline void desc_stats_sum(TxStats* sum) {
+    memset(sum, 0, sizeof(TxStats));
+    #ifdef _TO_USE_STATS_
+    #define DESC_STAT_SUM(counter) \
+        desc_stat_add(&(sum -> counter), atomic_load_explicit(&(desc -> stats.counter), memory_order_relaxed))
+    for (TxDesc* desc = atomic_load(&desc_all); desc != NULL; desc = desc -> next_all) {
+        DESC_STAT_SUM(commits);
+        DESC_STAT_SUM(aborts);
+        DESC_STAT_SUM(epochs);
+        DESC_STAT_SUM(epoch_writers);
+        DESC_STAT_SUM(tickets);
+        DESC_STAT_SUM(ticket_ns);
+        DESC_STAT_SUM(commit_bytes);
+        DESC_STAT_SUM(seg_allocs);
+        DESC_STAT_SUM(seg_frees);
+    }
+    #undef DESC_STAT_SUM
+    #endif
+}
+
+/** Descriptor embedding the given TL2 state.
+**/
+static inline TxDesc* desc_of_tl2(Tl2Tx* tx) {
+    return (TxDesc*)((uintptr_t)tx - offsetof(TxDesc, tl2));
+}
+
+// ==============================
+// Epoch-based reclamation: a transaction announces the clock when it begins,
+// a segment taken out of the index gets the clock as its stamp (bumping it),
+// and its memory is reclaimed once every running transaction announced more.
+
+/// @brief reclamation clock, 0 is the announcement of a thread out of transactions
+static atomic_ulong ebr_clock = 1;
+
+/** Announce a transaction, before it looks anything up in the index.
+ * @param desc Descriptor of the transaction
+**/
+static inline void ebr_enter(TxDesc* desc) {
+    atomic_store(&(desc -> announce), atomic_load(&ebr_clock));
+}
+
+static inline void ebr_exit(TxDesc* desc) {
+    atomic_store_explicit(&(desc -> announce), 0, memory_order_release);
+}
+
+/** Stamp of an object that was just made unreachable (taken out of the index).
+**/
+static inline ulong ebr_retire(void) {
+    return atomic_fetch_add(&ebr_clock, 1);
+}
+
+/** Objects stamped below the returned value cannot be referenced by any running transaction.
+**/
+static inline ulong ebr_horizon(void) {
+    ulong horizon = atomic_load(&ebr_clock);
+    for (TxDesc* desc = atomic_load(&desc_all); desc != NULL; desc = desc -> next_all) {
+        ulong announce = atomic_load(&(desc -> announce));
+        if (announce != 0 && announce < horizon)
+            horizon = announce;
+    }
+    return horizon;
+}
+
+/** Note why the transaction is about to roll back, for tm_last_abort.
+ * @param desc    Descriptor of the transaction
+ * @param why     TM_ABORT_*
+ * @param address Shared address of the access that failed, NULL if none
+ * @param owner   Transaction holding the word, invalid_tx if not known
+**/
+static inline void desc_abort_why(TxDesc* desc, int why, const void* address, tx_t owner) {
+    desc -> why = why;
+    desc -> why_address = address;
+    desc -> why_owner = owner;
+}
+
+static inline void trace_tx_end(TxDesc* desc, bool committed);
+
+/** The transaction is over: account for its outcome and withdraw its announcement.
+ * @param desc      Descriptor of the transaction
+ * @param committed Whether it committed (or aborted)
+**/
+static inline void desc_done(TxDesc* desc, bool committed) {
+    // read-only aborts say nothing about the next writer, and the other way around
+    ulong* retries = desc -> is_ro ? &(desc -> ro_retries) : &(desc -> rw_retries);
+    if (committed) {
+        desc_stat(desc, commits, 1);
+        *retries = 0;
+    } else {
+        desc_stat(desc, aborts, 1);
+        ++(*retries);
+    }
+    trace_tx_end(desc, committed);
+    ebr_exit(desc);
+}
+
+/** Threads must not run desc_release once the library is gone.
+**/
+__attribute__((destructor)) static void desc_key_unload(void) {
+    if (desc_key_made)
+        pthread_key_delete(desc_key);
+}
+
+#endif
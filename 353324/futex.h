@@ -0,0 +1,94 @@
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+// External headers
+#include <limits.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/// @brief how many times to poll before parking
+#define WAIT_SPIN 128
+
+/**
+ * @brief A word threads can park on until someone bumps it. Wakers only
+ * pay for the system call when somebody is actually parked.
+ */
+struct Waitpoint_str {
+    /// @brief bumped on every wake, what parked threads sleep on
+    atomic_uint seq;
+    /// @brief number of threads about to park or parked
+    atomic_uint waiters;
+};
+typedef struct Waitpoint_str Waitpoint;
+
+static inline void cpu_relax(void) {
+    #if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+    #elif defined(__aarch64__)
+    __asm__ volatile("yield");
+    #endif
+}
+
+static inline void futex_wait(atomic_uint* addr, unsigned int val) {
+    #ifdef __linux__
+    syscall(SYS_futex, (void*)addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+    #else
+    if (atomic_load(addr) == val)
+        sched_yield();
+    #endif
+}
+
+static inline void futex_wake(atomic_uint* addr) {
+    #ifdef __linux__
+    syscall(SYS_futex, (void*)addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    #else
+    (void)addr;
+    #endif
+}
+
+static inline void wp_init(Waitpoint* wp) {
+    atomic_init(&(wp -> seq), 0);
+    atomic_init(&(wp -> waiters), 0);
+}
+
+/** Announce we are about to park, the condition must be checked again afterwards.
+ * @param wp Waitpoint to park on
+ * @return Value to pass to wp_park
+**/
+static inline unsigned int wp_prepare(Waitpoint* wp) {
+    atomic_fetch_add(&(wp -> waiters), 1);
+    return atomic_load(&(wp -> seq));
+}
+
+/** Sleep until the waitpoint is woken after wp_prepare (returns at once if it already was).
+ * @param wp  Waitpoint to park on
+ * @param seq Value returned by wp_prepare
+**/
+static inline void wp_park(Waitpoint* wp, unsigned int seq) {
+    futex_wait(&(wp -> seq), seq);
+}
+
+/** Done waiting, to be called once per wp_prepare.
+ * @param wp Waitpoint parked on
+**/
+static inline void wp_cancel(Waitpoint* wp) {
+    atomic_fetch_sub(&(wp -> waiters), 1);
+}
+
+/** Wake every thread parked on the waitpoint, after changing what they wait on.
+ * @param wp Waitpoint to wake
+**/
+static inline void wp_wake(Waitpoint* wp) {
+    atomic_fetch_add(&(wp -> seq), 1);
+    if (atomic_load(&(wp -> waiters)) != 0)
+        futex_wake(&(wp -> seq));
+}
+
+#endif
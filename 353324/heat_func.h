@@ -0,0 +1,171 @@
+#ifndef _HEAT_H_
+#define _HEAT_H_
+
+// Conflict heatmap (_TO_USE_HEATMAP_): when a read or a write of the batcher
+// meets a stripe held by another transaction, one conflict out of
+// TM_HEAT_PERIOD (per thread) is counted against the stripe in a table of the
+// region, with the transaction that held it. The table has HEAT_SLOTS slots,
+// taken with a CAS and never given back, so a conflict on a new stripe when
+// its neighbourhood is full is only counted as dropped. tm_heatmap gives the
+// most contended stripes or segments, and tm_destroy writes them to stderr if
+// TM_HEAT_REPORT is set (to how many to write).
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "structs.h"
+#include "desc_func.h"
+#include "batcher_func.h"
+#include "macros.h"
+#include "tm_ext.h"
+
+#ifdef _TO_USE_HEATMAP_
+
+/** Make the heatmap of a region.
+ * @param period Record one conflict of a thread out of that many (0 is taken as 1)
+ * @return Heatmap, NULL if out of memory (conflicts are then not sampled)
+**/
+static inline Heat* heat_create(ulong period) {
+    Heat* heat = (Heat*)calloc(1, sizeof(Heat));
+    if (unlikely(heat == NULL))
+        return NULL;
+    heat -> period = period != 0 ? period : 1;
+    return heat;
+}
+
+/** Sample a conflict on a stripe.
+ * @param region Shared memory region
+ * @param desc   Descriptor of the transaction that met the conflict
+ * @param seg    Segment of the stripe
+ * @param start  Offset of the first byte of the stripe
+ * @param owner  Transaction holding the stripe, invalid_tx if not known
+**/
+static inline void heat_note(Region* region, TxDesc* desc, const Segment* seg, size_t start, tx_t owner) {
+    Heat* heat = region -> heat;
+    if (heat == NULL)
+        return;
+    if (desc -> heat_skip != 0) {
+        --(desc -> heat_skip);
+        return;
+    }
+    desc -> heat_skip = heat -> period - 1;
+
+    ulong key = (ulong)(uintptr_t)seg_vaddr(seg) + start + 1;
+    // Fibonacci hashing, the low bits of an address say little
+    size_t hash = (size_t)((key * 0x9e3779b97f4a7c15ul) >> 32);
+    for (size_t probe = 0; probe < HEAT_PROBE; ++probe) {
+        HeatSlot* slot = heat -> slots + (hash + probe) % HEAT_SLOTS;
+        ulong found = atomic_load_explicit(&(slot -> key), memory_order_relaxed);
+        if (found == 0 && atomic_compare_exchange_strong(&(slot -> key), &found, key))
+            found = key;
+        if (found != key)
+            continue;
+        atomic_fetch_add_explicit(&(slot -> conflicts), 1, memory_order_relaxed);
+        atomic_store_explicit(&(slot -> owner), owner, memory_order_relaxed);
+        return;
+    }
+    atomic_fetch_add_explicit(&(heat -> dropped), 1, memory_order_relaxed);
+}
+
+static int heat_by_address(const void* a, const void* b) {
+    uintptr_t x = (uintptr_t)((const struct tm_hot*)a) -> address;
+    uintptr_t y = (uintptr_t)((const struct tm_hot*)b) -> address;
+    return (x > y) - (x < y);
+}
+
+static int heat_by_conflicts(const void* a, const void* b) {
+    unsigned long x = ((const struct tm_hot*)a) -> conflicts;
+    unsigned long y = ((const struct tm_hot*)b) -> conflicts;
+    return (x < y) - (x > y);
+}
+
+/** The most contended stripes or segments of a region, most first.
+ * @param heat     Heatmap of the region
+ * @param top      Array to fill
+ * @param n        Length of the array
+ * @param segments Whether to sum the conflicts per segment
+ * @return Entries filled
+**/
+static inline size_t heat_top(Heat* heat, struct tm_hot* top, size_t n, bool segments) {
+    if (heat == NULL || n == 0)
+        return 0;
+    struct tm_hot* all = (struct tm_hot*)malloc(sizeof(struct tm_hot) * HEAT_SLOTS);
+    if (unlikely(all == NULL))
+        return 0;
+    size_t count = 0;
+    for (size_t i = 0; i < HEAT_SLOTS; ++i) {
+        HeatSlot* slot = heat -> slots + i;
+        ulong key = atomic_load_explicit(&(slot -> key), memory_order_relaxed);
+        ulong conflicts = atomic_load_explicit(&(slot -> conflicts), memory_order_relaxed);
+        if (key == 0 || conflicts == 0)
+            continue;
+        uintptr_t address = (uintptr_t)(key - 1);
+        all[count].address = (const void*)(segments ? address & ~seg_offset_mask : address);
+        all[count].conflicts = conflicts;
+        all[count].owner = atomic_load_explicit(&(slot -> owner), memory_order_relaxed);
+        ++count;
+    }
+
+    if (segments && count != 0) {
+        // the owner of a segment is the one of its hottest stripe
+        qsort(all, count, sizeof(struct tm_hot), heat_by_address);
+        size_t merged = 0;
+        unsigned long hottest = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (merged != 0 && all[merged - 1].address == all[i].address) {
+                all[merged - 1].conflicts += all[i].conflicts;
+            } else {
+                all[merged++] = all[i];
+                hottest = 0;
+            }
+            if (all[i].conflicts > hottest) {
+                hottest = all[i].conflicts;
+                all[merged - 1].owner = all[i].owner;
+            }
+        }
+        count = merged;
+    }
+
+    qsort(all, count, sizeof(struct tm_hot), heat_by_conflicts);
+    count = count < n ? count : n;
+    memcpy(top, all, sizeof(struct tm_hot) * count);
+    free(all);
+    return count;
+}
+
+/** Write the most contended stripes and segments of a region to stderr.
+ * @param heat Heatmap of the region
+ * @param n    How many of each
+**/
+static inline void heat_report(Heat* heat, size_t n) {
+    if (heat == NULL || n == 0)
+        return;
+    struct tm_hot* top = (struct tm_hot*)malloc(sizeof(struct tm_hot) * n);
+    if (unlikely(top == NULL))
+        return;
+    for (int segments = 0; segments <= 1; ++segments) {
+        size_t count = heat_top(heat, top, n, segments);
+        fprintf(stderr, "tm heatmap: %zu most contended %s (1 conflict out of %lu sampled, %lu dropped)\n",
+                count, segments ? "segments" : "stripes", heat -> period, atomic_load(&(heat -> dropped)));
+        for (size_t i = 0; i < count; ++i) {
+            if (top[i].owner == invalid_tx)
+                fprintf(stderr, "  %p: %lu conflicts, holder unknown\n", top[i].address, top[i].conflicts);
+            else
+                fprintf(stderr, "  %p: %lu conflicts, last held by %#lx\n",
+                        top[i].address, top[i].conflicts, (ulong)top[i].owner);
+        }
+    }
+    free(top);
+}
+
+#else
+
+static inline void heat_note(Region* region, TxDesc* desc, const Segment* seg, size_t start, tx_t owner) {
+    (void)region; (void)desc; (void)seg; (void)start; (void)owner;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,167 @@
+#ifndef _LOG_H_
+#define _LOG_H_
+
+// Leveled logging: log_error ... log_trace take printf arguments, and the
+// levels above TM_LOG_LEVEL (LOG_OFF by default) are not compiled in, their
+// arguments included. A thread formats its messages into a ring in its
+// descriptor and never writes them out itself: a background thread, started
+// with the first message, drains the rings of all threads to stderr. Threads
+// without a descriptor yet (e.g. in tm_create) write to stderr directly.
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "structs.h"
+#include "desc_func.h"
+#include "macros.h"
+
+#if TM_LOG_LEVEL >= LOG_ERROR
+#define log_error(...) log_write(LOG_ERROR, __VA_ARGS__)
+#else
+#define log_error(...) ((void)0)
+#endif
+#if TM_LOG_LEVEL >= LOG_WARN
+#define log_warn(...) log_write(LOG_WARN, __VA_ARGS__)
+#else
+#define log_warn(...) ((void)0)
+#endif
+#if TM_LOG_LEVEL >= LOG_INFO
+#define log_info(...) log_write(LOG_INFO, __VA_ARGS__)
+#else
+#define log_info(...) ((void)0)
+#endif
+#if TM_LOG_LEVEL >= LOG_DEBUG
+#define log_debug(...) log_write(LOG_DEBUG, __VA_ARGS__)
+#else
+#define log_debug(...) ((void)0)
+#endif
+#if TM_LOG_LEVEL >= LOG_TRACE
+#define log_trace(...) log_write(LOG_TRACE, __VA_ARGS__)
+#else
+#define log_trace(...) ((void)0)
+#endif
+
+#if TM_LOG_LEVEL > LOG_OFF
+
+#define LOG_IDLE_NS 1000000 // nap of the drainer when there was nothing to write
+
+static const char* const log_levels[] = {
+    [LOG_ERROR] = "error",
+    [LOG_WARN]  = "warn",
+    [LOG_INFO]  = "info",
+    [LOG_DEBUG] = "debug",
+    [LOG_TRACE] = "trace",
+};
+
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_t log_thread;
+static atomic_bool log_running = false;
+static atomic_bool log_stop = false;
+
+static void log_print(ulong ns, int level, const void* thread, const char* text) {
+    fprintf(stderr, "[tm %lu.%06lu %s %p] %s\n", ns / 1000000000ul, ns / 1000 % 1000000ul,
+            log_levels[level], thread, text);
+}
+
+/** Write out what the threads logged since the last call. Only called by the drainer.
+ * @return Whether there was anything to write
+**/
+static bool log_drain(void) {
+    bool wrote = false;
+    for (TxDesc* desc = atomic_load(&desc_all); desc != NULL; desc = desc -> next_all) {
+        ulong tail = atomic_load_explicit(&(desc -> log_tail), memory_order_relaxed);
+        ulong head = atomic_load_explicit(&(desc -> log_head), memory_order_acquire);
+        for (; tail < head; ++tail) {
+            const LogRecord* record = desc -> log_ring + (tail % LOG_RING);
+            log_print(record -> ns, record -> level, desc, record -> text);
+            wrote = true;
+        }
+        // the slots can be reused
+        atomic_store_explicit(&(desc -> log_tail), tail, memory_order_release);
+
+        ulong dropped = atomic_load_explicit(&(desc -> log_dropped), memory_order_relaxed);
+        if (dropped != desc -> log_dropped_seen) {
+            fprintf(stderr, "[tm %p] %lu messages dropped, the ring was full\n",
+                    (void*)desc, dropped - desc -> log_dropped_seen);
+            desc -> log_dropped_seen = dropped;
+            wrote = true;
+        }
+    }
+    if (wrote)
+        fflush(stderr);
+    return wrote;
+}
+
+static void* log_loop(void* unused(arg)) {
+    while (!atomic_load(&log_stop)) {
+        if (!log_drain()) {
+            struct timespec nap = { 0, LOG_IDLE_NS };
+            nanosleep(&nap, NULL);
+        }
+    }
+    log_drain();
+    return NULL;
+}
+
+static void log_start(void) {
+    if (pthread_create(&log_thread, NULL, log_loop, NULL) == 0)
+        atomic_store(&log_running, true);
+}
+
+/** Log a message, see log_error ... log_trace.
+ * @param level  LOG_*
+ * @param format printf format, then its arguments
+**/
+__attribute__((format(printf, 2, 3)))
+static void log_write(int level, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    TxDesc* desc = desc_self;
+    pthread_once(&log_once, log_start);
+
+    if (desc == NULL || !atomic_load(&log_running)) {
+        char text[LOG_TEXT];
+        vsnprintf(text, sizeof(text), format, args);
+        va_end(args);
+        log_print(now_ns(), level, desc, text);
+        return;
+    }
+    if (unlikely(desc -> log_ring == NULL)) {
+        desc -> log_ring = (LogRecord*)malloc(sizeof(LogRecord) * LOG_RING);
+        if (desc -> log_ring == NULL) {
+            va_end(args);
+            return;
+        }
+    }
+
+    ulong head = atomic_load_explicit(&(desc -> log_head), memory_order_relaxed);
+    if (head - atomic_load_explicit(&(desc -> log_tail), memory_order_acquire) == LOG_RING) {
+        // never wait for the drainer
+        atomic_store_explicit(&(desc -> log_dropped),
+            atomic_load_explicit(&(desc -> log_dropped), memory_order_relaxed) + 1, memory_order_relaxed);
+        va_end(args);
+        return;
+    }
+    LogRecord* record = desc -> log_ring + (head % LOG_RING);
+    record -> ns = now_ns();
+    record -> level = level;
+    vsnprintf(record -> text, LOG_TEXT, format, args);
+    va_end(args);
+    atomic_store_explicit(&(desc -> log_head), head + 1, memory_order_release);
+}
+
+/** Write out what is left before the library goes away.
+**/
+__attribute__((destructor)) static void log_unload(void) {
+    if (!atomic_load(&log_running))
+        return;
+    atomic_store(&log_stop, true);
+    pthread_join(log_thread, NULL);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,235 @@
+#ifndef _MVCC_H_
+#define _MVCC_H_
+
+// Multi-version reads for the batcher (_TO_USE_MVCC_): before a commit
+// overwrites a line of data, the committing thread saves the line as a
+// version, stamped with the commit_seq values it was current between. A
+// read-only transaction reads, per line, the data if it did not change since
+// its snapshot or else the version its snapshot saw, so it neither waits for
+// nor gets aborted by the commits. Versions nobody can read any more are
+// taken out of their chain and freed by epochs (see ebr_horizon).
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "structs.h"
+#include "desc_func.h"
+#include "batcher_func.h"
+#include "macros.h"
+
+#ifdef _TO_USE_MVCC_
+
+static inline size_t mvcc_line(const Segment* seg) {
+    return (size_t)1 << seg -> mv_shift;
+}
+
+static inline _Atomic(Version*)* mvcc_head(const Segment* seg, size_t offset) {
+    return seg -> versions + (offset >> seg -> mv_shift);
+}
+
+/** Save the committed state of a line before a commit overwrites it, once per commit.
+ * Only called by the committing thread.
+ * @param region Shared memory region
+ * @param seg    Segment of the line
+ * @param start  Offset of the first byte of the line
+ * @param until  commit_seq once the commit is over
+**/
+static inline void mvcc_save(Region* region, Segment* seg, size_t start, ulong until) {
+    _Atomic(Version*)* head = mvcc_head(seg, start);
+    Version* top = atomic_load_explicit(head, memory_order_relaxed);
+    if (top != NULL && top -> until == until)
+        return;
+    size_t size = mvcc_line(seg);
+    if (start + size > seg -> size)
+        size = seg -> size - start;
+    Version* version = (Version*)malloc(sizeof(Version) + sizeof(Word) * size);
+    if (unlikely(version == NULL)) {
+        // the snapshots this commit makes history of cannot be served any more
+        atomic_store(&(region -> mv_floor), until);
+        return;
+    }
+    version -> since = top != NULL ? top -> until : 0;
+    version -> until = until;
+    read_committed(seg, start, size, version -> bytes, region -> align);
+    atomic_init(&(version -> older), top);
+    version -> link = head;
+    version -> stamp = 0;
+    version -> cut = false;
+    version -> next = NULL;
+    if (top != NULL)
+        top -> link = &(version -> older);
+
+    if (region -> mv_live_tail != NULL)
+        region -> mv_live_tail -> next = version;
+    else
+        region -> mv_live = version;
+    region -> mv_live_tail = version;
+    if (region -> mv_fresh == NULL)
+        region -> mv_fresh = version;
+
+    atomic_store_explicit(head, version, memory_order_release);
+
+    // bound the chain, a reader that needs what is cut off gets aborted
+    Version* last = version;
+    for (int depth = 1; depth < MVCC_DEPTH && last != NULL; ++depth)
+        last = atomic_load_explicit(&(last -> older), memory_order_relaxed);
+    if (last == NULL)
+        return;
+    Version* cut = atomic_load_explicit(&(last -> older), memory_order_relaxed);
+    atomic_store_explicit(&(last -> older), NULL, memory_order_release);
+    for (; cut != NULL; cut = atomic_load_explicit(&(cut -> older), memory_order_relaxed))
+        cut -> cut = true;
+}
+
+/** Take out of their chain the versions no running transaction can need, and free those
+ * taken out earlier that no running transaction can hold any more.
+ * Only called by the committing thread, before it saves anything.
+ * @param region Shared memory region
+**/
+static inline void mvcc_collect(Region* region) {
+    if (region -> mv_live == NULL && region -> mv_dead == NULL)
+        return;
+    ulong horizon = ebr_horizon();
+
+    // stamps decrease along the dead list, cut it at the first version old enough
+    Version** link = &(region -> mv_dead);
+    while (*link != NULL && (*link) -> stamp >= horizon)
+        link = &((*link) -> next);
+    Version* dead = *link;
+    *link = NULL;
+    while (dead != NULL) {
+        Version* next = dead -> next;
+        free(dead);
+        dead = next;
+    }
+
+    // the previous commit is over: a transaction announced from now on has a later
+    // snapshot than any version saved so far
+    if (region -> mv_fresh != NULL) {
+        ulong stamp = ebr_retire();
+        for (Version* version = region -> mv_fresh; version != NULL; version = version -> next)
+            version -> stamp = stamp;
+        region -> mv_fresh = NULL;
+    }
+
+    // oldest first: the older versions of a chain are out already, so this one is its tail
+    ulong stamp = 0;
+    while (region -> mv_live != NULL && region -> mv_live -> stamp < horizon) {
+        Version* version = region -> mv_live;
+        region -> mv_live = version -> next;
+        if (!(version -> cut))
+            atomic_store_explicit(version -> link, NULL, memory_order_release);
+        // a reader may still be walking through it
+        if (stamp == 0)
+            stamp = ebr_retire();
+        version -> stamp = stamp;
+        version -> next = region -> mv_dead;
+        region -> mv_dead = version;
+    }
+    if (region -> mv_live == NULL)
+        region -> mv_live_tail = NULL;
+}
+
+/** Save the lines an epoch is about to overwrite. Called by Commit, before it applies them.
+ * @param region Shared memory region
+ * @param logs   Footprints handed to the batcher
+**/
+static inline void mvcc_capture(Region* region, TxLog* logs) {
+    mvcc_collect(region);
+    // commit_seq is odd during the commit
+    ulong until = atomic_load(&(region -> batcher -> commit_seq)) + 1;
+    for (TxLog* log = logs; log != NULL; log = log -> next) {
+        for (size_t n = 0; n < log -> size; ++n) {
+            const Access* access = log -> entries + n;
+            if (access -> kind != access_write && access -> kind != access_upgrade)
+                continue;
+            Segment* seg = access -> seg;
+            size_t end = access -> offset + access -> words * seg_stripe(seg);
+            if (end > seg -> size)
+                end = seg -> size;
+            size_t line = mvcc_line(seg);
+            for (size_t start = access -> offset / line * line; start < end; start += line)
+                mvcc_save(region, seg, start, until);
+        }
+    }
+    // the versions are in place before the data changes
+    atomic_thread_fence(memory_order_release);
+}
+
+/** Detach the chains of a segment about to be freed, their versions go with the epochs.
+ * @param seg Segment
+**/
+static inline void mvcc_detach(Segment* seg) {
+    size_t lines = (seg -> size + mvcc_line(seg) - 1) / mvcc_line(seg);
+    for (size_t line = 0; line < lines; ++line) {
+        Version* version = atomic_load_explicit(seg -> versions + line, memory_order_relaxed);
+        for (; version != NULL; version = atomic_load_explicit(&(version -> older), memory_order_relaxed))
+            version -> cut = true;
+    }
+}
+
+/** Read part of a line as of a snapshot.
+ * @return Whether the state of the snapshot is still around
+**/
+static inline bool mvcc_read_line(const Segment* seg, size_t offset, size_t size, void* target, ulong snapshot, size_t step) {
+    _Atomic(Version*)* head = mvcc_head(seg, offset);
+    for (;;) {
+        Version* version = atomic_load_explicit(head, memory_order_acquire);
+        if (version == NULL || version -> until <= snapshot) {
+            // the data is what the snapshot saw, unless a commit saves the line meanwhile
+            read_committed(seg, offset, size, target, step);
+            atomic_thread_fence(memory_order_acquire);
+            if (likely(atomic_load_explicit(head, memory_order_relaxed) == version))
+                return true;
+            continue;
+        }
+        while (version != NULL && version -> since > snapshot)
+            version = atomic_load_explicit(&(version -> older), memory_order_acquire);
+        if (unlikely(version == NULL))
+            return false;
+        memcpy(target, version -> bytes + (offset & (mvcc_line(seg) - 1)), sizeof(Word) * size);
+        return true;
+    }
+}
+
+/** Read committed words as of a snapshot, for read-only transactions.
+ * @param region   Shared memory region
+ * @param seg      Segment to read from
+ * @param offset   Offset of the first word
+ * @param size     Number of bytes
+ * @param target   Private buffer
+ * @param snapshot commit_seq when the transaction began
+ * @return Whether the state of the snapshot is still around
+**/
+static inline bool mvcc_read(Region* region, const Segment* seg, size_t offset, size_t size, void* target, ulong snapshot) {
+    if (unlikely(snapshot < atomic_load_explicit(&(region -> mv_floor), memory_order_relaxed)))
+        return false;
+    size_t line = mvcc_line(seg);
+    for (size_t done = 0; done < size; ) {
+        size_t part = line - ((offset + done) & (line - 1));
+        part = part < size - done ? part : size - done;
+        if (!mvcc_read_line(seg, offset + done, part, (Word*)target + done, snapshot, region -> align))
+            return false;
+        done += part;
+    }
+    return true;
+}
+
+/** Free every version of a region being destroyed.
+ * @param region Shared memory region
+**/
+static inline void mvcc_destroy(Region* region) {
+    Version* lists[] = { region -> mv_live, region -> mv_dead };
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); ++i) {
+        while (lists[i] != NULL) {
+            Version* next = lists[i] -> next;
+            free(lists[i]);
+            lists[i] = next;
+        }
+    }
+}
+
+#endif
+
+#endif
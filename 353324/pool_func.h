@@ -0,0 +1,183 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+// Segment pool: blocks in power-of-two size classes, recycled instead of
+// going back to malloc. Each thread keeps a magazine of blocks per class in
+// its descriptor and only takes the pool lock to refill or drain half of it.
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "structs.h"
+#include "macros.h"
+
+/// @brief blocks of one size class shared by all threads
+struct PoolClass_str {
+    pthread_mutex_t lock;
+    void* blocks[POOL_KEEP];
+    size_t count;
+    /// @brief blocks of this class that exist (in use or cached anywhere)
+    atomic_ulong made;
+};
+typedef struct PoolClass_str PoolClass;
+
+static PoolClass pool[POOL_CLASSES] = {
+    [0 ... POOL_CLASSES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+static inline size_t pool_class_bytes(int class) {
+    return (size_t)1 << (POOL_MIN_SHIFT + class);
+}
+
+/** Size class of a block of the given size.
+ * @param bytes Size of the block
+ * @param align Alignment of the block
+ * @return Class, POOL_NONE if the pool does not serve it
+**/
+static inline int pool_class_of(size_t bytes, size_t align) {
+    if (unlikely(align > POOL_ALIGN))
+        return POOL_NONE;
+    for (int class = 0; class < POOL_CLASSES; ++class) {
+        if (bytes <= pool_class_bytes(class))
+            return class;
+    }
+    return POOL_NONE;
+}
+
+/** Move up to n blocks from the shared pool to a magazine.
+**/
+static inline void pool_refill(int class, SegMag* mag, size_t n) {
+    PoolClass* shared = pool + class;
+    pthread_mutex_lock(&(shared -> lock));
+    while (n-- > 0 && shared -> count > 0 && mag -> count < POOL_MAG)
+        mag -> blocks[mag -> count++] = shared -> blocks[--(shared -> count)];
+    pthread_mutex_unlock(&(shared -> lock));
+}
+
+/** Move up to n blocks from a magazine to the shared pool, freeing what it cannot keep.
+**/
+static inline void pool_drain(int class, SegMag* mag, size_t n) {
+    PoolClass* shared = pool + class;
+    pthread_mutex_lock(&(shared -> lock));
+    while (n-- > 0 && mag -> count > 0) {
+        void* block = mag -> blocks[--(mag -> count)];
+        if (shared -> count < POOL_KEEP) {
+            shared -> blocks[shared -> count++] = block;
+        } else {
+            free(block);
+            atomic_fetch_sub_explicit(&(shared -> made), 1, memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&(shared -> lock));
+}
+
+/** Take a block of the given class, from the magazine if there is one.
+ * @param class Size class
+ * @param mags  Magazines of the calling thread, NULL to use the shared pool only
+ * @return Block (not zeroed), NULL if out of memory
+**/
+static inline void* pool_get(int class, SegMag* mags) {
+    SegMag local = { .count = 0 };
+    SegMag* mag = mags ? mags + class : &local;
+    if (mag -> count == 0)
+        pool_refill(class, mag, mags ? POOL_MAG / 2 : 1);
+    if (likely(mag -> count > 0))
+        return mag -> blocks[--(mag -> count)];
+
+    void* block;
+    if (unlikely(posix_memalign(&block, POOL_ALIGN, pool_class_bytes(class)) != 0))
+        return NULL;
+    atomic_fetch_add_explicit(&(pool[class].made), 1, memory_order_relaxed);
+    return block;
+}
+
+/** Give a block back.
+ * @param class Size class
+ * @param mags  Magazines of the calling thread, NULL to use the shared pool only
+ * @param block Block taken with pool_get
+**/
+static inline void pool_put(int class, SegMag* mags, void* block) {
+    SegMag local = { .count = 0 };
+    SegMag* mag = mags ? mags + class : &local;
+    if (mag -> count == POOL_MAG)
+        pool_drain(class, mag, POOL_MAG / 2);
+    mag -> blocks[mag -> count++] = block;
+    if (mags == NULL)
+        pool_drain(class, mag, 1);
+}
+
+/** Map zeroed memory for a block the pool does not serve, so that a big region costs
+ * neither a memset nor a page fault per page up front. A block of at least
+ * HUGE_PAGE_BYTES starts on a huge page and is advised as one, for fewer TLB misses.
+ * @param bytes  Size of the block
+ * @param mapped Set to the bytes to give to pool_unmap
+ * @return Block (zeroed, aligned to MAP_ALIGN at least), NULL if out of memory
+**/
+static inline void* pool_map(size_t bytes, size_t* mapped) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    bytes = (bytes + page - 1) / page * page;
+    #if defined(MADV_HUGEPAGE) && !defined(_NO_HUGE_PAGES_)
+    if (bytes >= HUGE_PAGE_BYTES) {
+        // map a huge page more, then trim both ends to start on a huge page boundary
+        size_t over = bytes + HUGE_PAGE_BYTES - page;
+        void* raw = mmap(NULL, over, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (unlikely(raw == MAP_FAILED))
+            return NULL;
+        uintptr_t start = ((uintptr_t)raw + HUGE_PAGE_BYTES - 1) & ~(HUGE_PAGE_BYTES - 1);
+        if (start > (uintptr_t)raw)
+            munmap(raw, start - (uintptr_t)raw);
+        size_t tail = (uintptr_t)raw + over - (start + bytes);
+        if (tail > 0)
+            munmap((void*)(start + bytes), tail);
+        // only a hint, the kernel may not have transparent huge pages enabled
+        madvise((void*)start, bytes, MADV_HUGEPAGE);
+        *mapped = bytes;
+        return (void*)start;
+    }
+    #endif
+    void* block = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (unlikely(block == MAP_FAILED))
+        return NULL;
+    *mapped = bytes;
+    return block;
+}
+
+/** Give back a block taken with pool_map.
+**/
+static inline void pool_unmap(void* block, size_t mapped) {
+    munmap(block, mapped);
+}
+
+/** Give all the blocks of a thread back to the shared pool (when it exits).
+ * @param mags Magazines of the thread
+**/
+static inline void pool_flush(SegMag* mags) {
+    for (int class = 0; class < POOL_CLASSES; ++class)
+        pool_drain(class, mags + class, POOL_MAG);
+}
+
+/** Blocks made by the pool and blocks sitting in the shared pool.
+ * Blocks in magazines are counted by the caller, see tm_stats.
+**/
+static inline void pool_occupancy(int class, ulong* made, ulong* cached) {
+    PoolClass* shared = pool + class;
+    pthread_mutex_lock(&(shared -> lock));
+    *cached = shared -> count;
+    pthread_mutex_unlock(&(shared -> lock));
+    *made = atomic_load_explicit(&(shared -> made), memory_order_relaxed);
+}
+
+/** Free what the shared pool holds when the library is unloaded.
+**/
+__attribute__((destructor)) static void pool_unload(void) {
+    for (int class = 0; class < POOL_CLASSES; ++class) {
+        while (pool[class].count > 0)
+            free(pool[class].blocks[--(pool[class].count)]);
+    }
+}
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+// Bulk kernels over control words: the commit releases whole runs of words at
+// once (see Commit_access), 4 words per store with AVX2, 2 with SSE2, one at a
+// time otherwise. AVX2 is only used when the build enables it (e.g. -mavx2).
+// Vector accesses are not atomic: words other threads may CAS while the epoch
+// runs are read with atomic loads instead (see read_own).
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "structs.h"
+
+/** Release a run of consecutive control words. Only for the committing thread: nobody else
+ * touches the control words until the next epoch opens, which publishes the stores.
+ * @param control First control word of the run
+ * @param words   Number of control words
+**/
+static inline void ctl_clear(atomic_ulong* control, size_t words) {
+    size_t i = 0;
+    #if defined(__AVX2__)
+    const __m256i zero = _mm256_setzero_si256();
+    for (; i + 4 <= words; i += 4)
+        _mm256_storeu_si256((__m256i*)(control + i), zero);
+    #elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 2 <= words; i += 2)
+        _mm_storeu_si128((__m128i*)(control + i), zero);
+    #endif
+    for (; i < words; ++i)
+        atomic_store_explicit(control + i, it_is_free, memory_order_relaxed);
+}
+
+#endif
@@ -7,45 +7,261 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdatomic.h>
+#include <time.h>
 
 // Internal headers
 #include "Mytm.h"
 
 #include "macros.h"
 #include "shared-lock.h"
+#include "futex.h"
 
 // Constants and types
 static const tx_t read_only_tx  = UINTPTR_MAX - 1;
 static const tx_t read_write_tx = UINTPTR_MAX - 2;
 static const tx_t to_delete = UINTPTR_MAX - 3;
 static const tx_t it_is_free    = 0; //UINTPTR_MAX - 4;
-static const ulong batch_size = 2; 
-// static const ulong batch_size = 1; 
+/// @brief read-only transaction that gave up on snapshots and joined the epoch
+static const tx_t read_only_epoch_tx = UINTPTR_MAX - 4;
+/// @brief snapshot aborts in a row before a read-only transaction joins the epoch instead
+static const ulong ro_retry_max = 8;
+// bounds of the number of writers admitted per epoch, see epoch_resize
+static const ulong epoch_size_init = 2;
+static const ulong epoch_size_min  = 1;
+#define EPOCH_SIZE_MAX 256 // also sizes arrays indexed by writer id
+static const ulong epoch_size_max  = EPOCH_SIZE_MAX;
+
+// Segment index: the top bits of a shared address hold the segment id,
+// the low bits hold the byte offset inside that segment. The slot of a
+// deleted segment holds SEG_TOMBSTONE until its memory is reclaimed. The
+// slots come in pages of SEG_PAGE, allocated once the ones there are full.
+#define SEG_SHIFT 48
+#define SEG_MAX   (1ul << (64 - SEG_SHIFT)) // every id the top bits can hold
+#define SEG_PAGE_SHIFT 10
+#define SEG_PAGE  (1ul << SEG_PAGE_SHIFT)
+#define SEG_PAGES (SEG_MAX / SEG_PAGE)
+static const uintptr_t seg_offset_mask = (1ul << SEG_SHIFT) - 1;
+static const ulong start_seg_id = 1;
+#define SEG_TOMBSTONE ((Segment*)1)
+
+// Control word of a word of shared memory: a tag in the top two bits, then the
+// owner (a writer id) or the number of readers
+#define CTL_TAG_MASK  (3ul << 62)
+#define CTL_READ_ONE  (1ul << 62)  // read-marked by one transaction, whose id follows
+#define CTL_READ_MANY (2ul << 62)  // read-marked by the number of transactions that follows
+#define CTL_WRITE     (3ul << 62)  // locked by the writer whose id follows
+static inline ulong ctl_tag(ulong ctl) { return ctl & CTL_TAG_MASK; }
+static inline ulong ctl_val(ulong ctl) { return ctl & ~CTL_TAG_MASK; }
+
+// Segment pool (see pool_func.h): size classes of 2^POOL_MIN_SHIFT to
+// 2^(POOL_MIN_SHIFT + POOL_CLASSES - 1) bytes, bigger segments bypass it
+#define POOL_MIN_SHIFT 8
+#define POOL_CLASSES   13
+#define POOL_MAG       16  // blocks per class a thread keeps at hand
+#define POOL_KEEP      256 // blocks per class kept in the shared pool, the rest is freed
+#define POOL_ALIGN     64  // alignment of the blocks, regions aligned more bypass the pool
+#define POOL_NONE      (-1)
+// Segments the pool does not serve are mapped on their own (see pool_map):
+// the pages come zeroed, and mappings of at least HUGE_PAGE_BYTES start on a
+// huge page and are advised as such (unless _NO_HUGE_PAGES_)
+#define MAP_ALIGN       4096            // alignment mmap guarantees, regions aligned more use malloc
+#define HUGE_PAGE_BYTES ((size_t)2 << 20)
+// _TO_USE_MVCC_ (see mvcc_func.h): older states kept per line of a segment,
+// newest first, the chain is cut past MVCC_DEPTH versions
+#define MVCC_DEPTH 8
+
+#define CACHE_LINE 64
+
+// _TO_USE_TRACE_ (see trace_func.h): events kept per thread, the oldest get overwritten
+#define TRACE_RING ((size_t)1 << 15)
+
+// Log levels (see log_func.h): the calls of the levels above TM_LOG_LEVEL are
+// not compiled in, e.g. make build DEFINES=-DTM_LOG_LEVEL=LOG_DEBUG
+#define LOG_OFF   0
+#define LOG_ERROR 1
+#define LOG_WARN  2
+#define LOG_INFO  3
+#define LOG_DEBUG 4
+#define LOG_TRACE 5
+#ifndef TM_LOG_LEVEL
+#define TM_LOG_LEVEL LOG_OFF
+#endif
+#define LOG_RING 256 // records per thread waiting to be written, a full ring drops new ones
+#define LOG_TEXT 112 // bytes of a formatted record, longer ones get truncated
+
+// _TO_USE_HEATMAP_ (see heat_func.h): stripes counted per region, a conflict
+// on a stripe that finds no slot within HEAT_PROBE of its hash is dropped
+#define HEAT_SLOTS 4096
+#define HEAT_PROBE 16
+#define HEAT_PERIOD_DEFAULT 1 // record one conflict of a thread out of that many
+
+// Contention manager (see cm_func.h)
+#define CM_RUNNING 0
+#define CM_DOOMED  1
+#define CM_DONE    2
+#define CM_PHASE_BITS      2           // cm_state is the writer id, then one of the above
+#define CM_WAIT_MAX        (1ul << 16) // spins waiting for a doomed owner before giving up
+#define CM_BACKOFF_NS      256         // first backoff after an abort, doubled each retry
+#define CM_BACKOFF_SHIFT   12          // up to CM_BACKOFF_NS << CM_BACKOFF_SHIFT
 
 // typedef char tx_t; // The type of a transaction identifier
 typedef _Atomic(tx_t) atomic_tx;
 
+/// @brief place of a thread in the queue for the turn (see ticket_take), one per descriptor
+struct QNode_str {
+    /// @brief who queued up behind us
+    _Alignas(CACHE_LINE) _Atomic(struct QNode_str*) next;
+    /// @brief 1 while waiting, 2 while waiting parked, 0 once it is our turn
+    atomic_uint wait;
+};
+typedef struct QNode_str QNode;
+
+/**
+ * @brief Each group of fields written by different threads sits on its own cache line:
+ * threads queue up for the turn on the tail alone, each waits on its own QNode, and
+ * what only the thread holding the turn touches shares a line that moves with the turn.
+ */
 struct Batcher_str{
-    /// @brief ts to assign to the next requring thread
-    atomic_tx timestamp;
-    /// @brief next thread to process
-    atomic_tx next; 
-    /// @brief which epoch this batcher is in
-    atomic_ulong cnt_epoch;
+    /// @brief last thread queued up for the turn (MCS queue lock, FIFO like a ticket lock)
+    _Alignas(CACHE_LINE) _Atomic(QNode*) tail;
+
+    // ---- only written by the thread holding the turn (see held_add)
     /// @brief Number of threads in this epoch
-    atomic_ulong cnt_thread;
+    _Alignas(CACHE_LINE) atomic_ulong cnt_thread;
     /// @brief Number of slots remaining for writing threads in this epoch
     atomic_ulong res_writes;
     /// @brief indicate there is a writing thread in this epoch
     atomic_bool is_writing;
+    /// @brief number of writers admitted per epoch, chosen when an epoch starts
+    atomic_ulong epoch_size;
+    /// @brief writers that found the epoch full and wait for the next one
+    atomic_ulong epoch_waiting;
+    /// @brief when this epoch started (ns)
+    ulong epoch_start_ns;
+    /// @brief smoothed abort rate of writers (per mille), commit time and epoch length (ns)
+    atomic_ulong avg_abort_permille;
+    atomic_ulong avg_commit_ns;
+    atomic_ulong avg_epoch_ns;
 
-    // TBD
+    /// @brief which epoch this batcher is in, polled by the writers waiting for it to end
+    _Alignas(CACHE_LINE) atomic_ulong cnt_epoch;
+    /// @brief where threads waiting for the epoch to end park, woken all at once
+    Waitpoint epoch_wp;
+
+    /// @brief odd while the last thread of an epoch commits, bumped twice per commit;
+    /// read-only transactions check it did not move to know their reads are consistent
+    _Alignas(CACHE_LINE) atomic_ulong commit_seq;
+
+    /// @brief footprints of the transactions that ended in this epoch,
+    /// committed (or cleaned up) by the last thread out
+    _Alignas(CACHE_LINE) _Atomic(struct TxLog_str*) logs;
+
+    /// @brief writers that aborted in this epoch
+    _Alignas(CACHE_LINE) atomic_ulong epoch_aborts;
+    /// @brief transactions a contention manager had roll back for another one
+    atomic_ulong cm_kills;
+
+    /// @brief writer id -> descriptor of the writer holding it in this epoch (see cm_func.h)
+    _Alignas(CACHE_LINE) _Atomic(struct TxDesc_str*) owners[EPOCH_SIZE_MAX + 1];
 };
 typedef struct Batcher_str Batcher; 
+// ==============================
+// Clock
+
+/** Monotonic clock in ns, for the epoch sizing, the contention manager, the trace and the log.
+**/
+static inline ulong now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ulong)ts.tv_sec * 1000000000ul + (ulong)ts.tv_nsec;
+}
+
 // ==============================
 // Batcher Functions
 static inline ulong get_epoch(const Batcher* batcher) { return atomic_load(&(batcher -> cnt_epoch)); }
 
+static inline bool is_read_only(tx_t id) { return id == read_only_tx || id == read_only_epoch_tx; }
+
+/** Add to a counter only written by the thread holding the turn, no read-modify-write needed.
+ * @param counter Counter
+ * @param delta   What to add
+ * @return Value before
+**/
+static inline ulong held_add(atomic_ulong* counter, long delta) {
+    ulong value = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, value + delta, memory_order_relaxed);
+    return value;
+}
+
+/** Queue up and wait for our turn (the thread before us hands it over): spin a little on
+ * our own node, then park on it.
+ * @param batcher Batcher of the region
+ * @param node    Node of the calling thread
+**/
+static inline void ticket_take(Batcher* batcher, QNode* node) {
+    atomic_store_explicit(&(node -> next), NULL, memory_order_relaxed);
+    atomic_store_explicit(&(node -> wait), 1, memory_order_relaxed);
+    QNode* prev = atomic_exchange(&(batcher -> tail), node);
+    if (likely(prev == NULL))
+        return;
+    atomic_store_explicit(&(prev -> next), node, memory_order_release);
+
+    for (int spin = 0; spin < WAIT_SPIN; ++spin) {
+        if (likely(atomic_load_explicit(&(node -> wait), memory_order_acquire) == 0))
+            return;
+        cpu_relax();
+    }
+    unsigned int waiting = 1;
+    atomic_compare_exchange_strong(&(node -> wait), &waiting, 2);
+    while (atomic_load(&(node -> wait)) != 0)
+        futex_wait(&(node -> wait), 2);
+}
+
+/** Hand the turn over to the next thread in the queue, waking it only if it parked.
+ * @param batcher Batcher of the region
+ * @param node    Node of the calling thread, which holds the turn
+**/
+static inline void ticket_pass(Batcher* batcher, QNode* node) {
+    QNode* next = atomic_load_explicit(&(node -> next), memory_order_acquire);
+    if (next == NULL) {
+        QNode* expected = node;
+        if (atomic_compare_exchange_strong(&(batcher -> tail), &expected, NULL))
+            return;
+        // someone is queuing up behind us, wait until it says who it is
+        while ((next = atomic_load_explicit(&(node -> next), memory_order_acquire)) == NULL)
+            cpu_relax();
+    }
+    // nodes live as long as the library, the wake is harmless if it already left
+    if (atomic_exchange(&(next -> wait), 0) == 2)
+        futex_wake(&(next -> wait));
+}
+
+/** Wait until the batcher leaves the given epoch: spin a little, then park.
+ * @param batcher Batcher of the region
+ * @param epoch   Epoch to wait out, read while holding a ticket
+**/
+static inline void epoch_wait(Batcher* batcher, ulong epoch) {
+    for (int spin = 0; spin < WAIT_SPIN; ++spin) {
+        if (likely(epoch != get_epoch(batcher)))
+            return;
+        cpu_relax();
+    }
+    while (epoch == get_epoch(batcher)) {
+        unsigned int seq = wp_prepare(&(batcher -> epoch_wp));
+        if (epoch == get_epoch(batcher))
+            wp_park(&(batcher -> epoch_wp), seq);
+        wp_cancel(&(batcher -> epoch_wp));
+    }
+}
+
+/** Start a new epoch and wake everyone waiting for it.
+ * @param batcher Batcher of the region
+**/
+static inline void epoch_advance(Batcher* batcher) {
+    atomic_fetch_add(&(batcher -> cnt_epoch), 1);
+    wp_wake(&(batcher -> epoch_wp));
+}
+
 
 struct Word_str {
     void* data1;
@@ -56,29 +272,336 @@ struct Word_str {
 // typedef struct Word_str Word;
 typedef _Atomic(uint8_t) Word;
 
+#ifdef _TO_USE_MVCC_
+/// @brief an older committed state of a line of a segment, see mvcc_func.h
+struct Version_str {
+    /// @brief commit_seq values from which and until which this was the committed state
+    ulong since;
+    ulong until;
+    /// @brief next older version, NULL at the end of the chain (or where it was cut)
+    _Atomic(struct Version_str*) older;
+    /// @brief slot pointing to this version: the head of the line or older of the newer version
+    _Atomic(struct Version_str*)* link;
+    /// @brief reclamation stamp (see mvcc_collect), 0 until the commit that made it is over
+    ulong stamp;
+    /// @brief no longer in the chain (cut by depth, or the segment went away)
+    bool cut;
+    /// @brief next version in region -> mv_live (oldest first) or region -> mv_dead
+    struct Version_str* next;
+    Word bytes[];
+};
+typedef struct Version_str Version;
+#endif
+
 struct Segment_str {
     // Batcher batcher;
     Word* data; 
     Word* shadow; 
-    char* control;
+    /// @brief one control word per word of the segment (see CTL_*)
+    atomic_ulong* control;
+    #ifdef _TO_USE_DUAL_COPY_
+    /// @brief per word, 0 if data is the readable copy, 1 if shadow is
+    uint8_t* valid;
+    #endif
+    /// @brief TM_LAYOUT_INTERLEAVED only: data bytes per block (a cache line or a word,
+    /// whichever is bigger) as a shift, and bytes per block; data points to the first block
+    size_t line_shift;
+    size_t block;
+    /// @brief each control word covers a stripe of 2^stripe_shift bytes (see word_control)
+    size_t stripe_shift;
+    #ifdef _TO_USE_MVCC_
+    /// @brief per line of 2^mv_shift bytes, its newest older version (after the control words)
+    _Atomic(Version*)* versions;
+    size_t mv_shift;
+    #endif
     size_t size; 
+    /// @brief size class of the pool block holding the segment, POOL_NONE if not pooled
+    int pool_class;
+    /// @brief bytes mapped for the segment, 0 if it does not own a mapping
+    size_t mapped;
+    /// @brief slot in region -> index, also the top bits of its shared addresses
+    ulong id;
     /// @brief actually it's the creator of this segment
-    atomic_char creator; 
+    _Atomic(tx_t) creator; 
     atomic_bool to_delete; 
-    struct Segment_str* next;
-    struct Segment_str* previous; 
+    /// @brief reclamation stamp taken when the segment went to the limbo, see ebr_retire
+    ulong retired;
+    /// @brief deleted for good, waiting for seglist_sweep to unlink it
+    atomic_bool dead;
+    /// @brief next segment in region -> allocs, still valid once unlinked
+    _Atomic(struct Segment_str*) next;
+    /// @brief next segment in region -> limbo
+    struct Segment_str* retired_next;
     // TBD
 }; 
 typedef struct Segment_str Segment; 
 
+// ==============================
+// Transaction footprint
+
+/// @brief what a transaction did to a word (or a segment)
+enum Access_kind {
+    access_read,    // read-marked the control word
+    access_write,   // locked the control word and wrote the shadow
+    access_upgrade, // locked the control word it alone read-marked, and wrote the shadow
+    access_alloc,   // created the segment
+    access_free,    // marked the segment to be deleted at the end of the epoch
+    access_drop     // created the segment and rolled back, it goes with the epoch too
+};
+
+struct Access_str {
+    Segment* seg;
+    /// @brief offset of the first stripe in the segment, unused for alloc/free
+    size_t offset;
+    /// @brief number of consecutive stripes (control words) from offset, 1 for alloc/free
+    size_t words;
+    enum Access_kind kind;
+};
+typedef struct Access_str Access;
+
+/// @brief everything a transaction locked, read-marked, allocated or freed
+struct TxLog_str {
+    Access* entries;
+    size_t size;
+    size_t capacity;
+    /// @brief next footprint handed to the batcher in the same epoch
+    struct TxLog_str* next;
+};
+typedef struct TxLog_str TxLog;
+
+// ==============================
+// TL2 engine (see tl2_func.h)
+
+/// @brief a word written by a TL2 transaction, locked at commit
+struct Tl2Write_str {
+    Segment* seg;
+    size_t offset;
+    /// @brief versioned lock of the word
+    atomic_ulong* lock;
+    /// @brief version of the word when we locked it
+    ulong old;
+    /// @brief false for the words of a freed segment, only locked to bump their version
+    bool has_value;
+    /// @brief slot of this entry in Tl2Tx.table
+    size_t slot;
+};
+typedef struct Tl2Write_str Tl2Write;
+
+/// @brief state of the TL2 transaction running on a thread, tx_t points to it
+struct Tl2Tx_str {
+    bool is_ro;
+    /// @brief global clock when the transaction began
+    ulong rv;
+    /// @brief versioned locks read so far (read-write transactions only)
+    atomic_ulong** reads;
+    size_t nb_reads;
+    size_t cap_reads;
+    /// @brief write set, the buffered value of writes[i] is at values + i * align
+    Tl2Write* writes;
+    Word* values;
+    size_t nb_writes;
+    size_t cap_writes;
+    /// @brief lock -> index + 1 in writes, open addressing, 0 if empty
+    size_t* table;
+    size_t cap_table;
+    /// @brief segments allocated and freed (access_alloc / access_free)
+    TxLog segs;
+};
+typedef struct Tl2Tx_str Tl2Tx;
+
+// ==============================
+// Transaction descriptors (see desc_func.h)
+
+/// @brief blocks of one size class cached by a thread
+struct SegMag_str {
+    void* blocks[POOL_MAG];
+    size_t count;
+};
+typedef struct SegMag_str SegMag;
+
+/// @brief counters of a thread (_TO_USE_STATS_, see desc_stat): only its thread
+/// writes them, tm_stats sums them over all the descriptors
+struct TxStats_str {
+    /// @brief transactions committed and aborted
+    _Alignas(CACHE_LINE) atomic_ulong commits;
+    atomic_ulong aborts;
+    /// @brief epochs this thread committed, and the writers admitted in them
+    atomic_ulong epochs;
+    atomic_ulong epoch_writers;
+    /// @brief turns taken, and the time spent waiting for them (ns)
+    atomic_ulong tickets;
+    atomic_ulong ticket_ns;
+    /// @brief bytes applied by the commits of this thread
+    atomic_ulong commit_bytes;
+    /// @brief segments whose allocation or freeing this thread committed
+    atomic_ulong seg_allocs;
+    atomic_ulong seg_frees;
+};
+typedef struct TxStats_str TxStats;
+
+enum Trace_kind {
+    trace_tx,     // a transaction, from tm_begin to its commit or abort
+    trace_ticket, // waiting for the turn of the batcher
+    trace_read,
+    trace_write,
+    trace_abort,
+    trace_epoch,  // the last thread out of an epoch opened the next one
+    trace_commit, // the last thread out of an epoch applying it
+};
+
+/// @brief event of a trace ring, spans have a duration, the others do not
+struct TraceEvent_str {
+    /// @brief time stamp counter when the event (or span) began
+    ulong tsc;
+    /// @brief length of the span in ticks, 0 for an instant event
+    ulong ticks;
+    /// @brief Trace_kind
+    uint32_t kind;
+    /// @brief bytes read or written, whether the transaction committed, epoch...
+    uint32_t arg;
+};
+typedef struct TraceEvent_str TraceEvent;
+
+/// @brief conflicts sampled on a stripe, see heat_note
+struct HeatSlot_str {
+    /// @brief shared address of the stripe + 1, 0 while the slot is free
+    atomic_ulong key;
+    atomic_ulong conflicts;
+    /// @brief transaction that held the stripe the last time, invalid_tx if not known
+    atomic_tx owner;
+};
+typedef struct HeatSlot_str HeatSlot;
+
+/// @brief conflict heatmap of a region, an open addressing table that only grows
+struct Heat_str {
+    /// @brief TM_HEAT_PERIOD
+    ulong period;
+    /// @brief conflicts that found no slot
+    atomic_ulong dropped;
+    HeatSlot slots[HEAT_SLOTS];
+};
+typedef struct Heat_str Heat;
+
+/// @brief formatted log message, waiting in the ring of its thread
+struct LogRecord_str {
+    /// @brief monotonic clock when it was logged (ns)
+    ulong ns;
+    /// @brief LOG_*
+    int level;
+    char text[LOG_TEXT];
+};
+typedef struct LogRecord_str LogRecord;
+
+/// @brief per-thread transaction state, tx_t points to it; taken from a pool
+/// the first time a thread begins a transaction and given back when it exits
+struct TxDesc_str {
+    /// @brief what the batcher knows the transaction as: the writer id in the epoch
+    /// (what goes in the control words), read_only_tx or read_only_epoch_tx
+    tx_t id;
+    /// @brief batcher footprint
+    TxLog log;
+    /// @brief commit_seq seen when the read-only snapshot began
+    ulong ro_snapshot;
+    /// @brief whether the transaction is read-only, as given to tm_begin
+    bool is_ro;
+    /// @brief aborts in a row of the read-only and of the read-write transactions of
+    /// the thread, each back to 0 when one of its kind commits
+    ulong ro_retries;
+    ulong rw_retries;
+    /// @brief why the last aborted transaction did: TM_ABORT_*, address, owner (see tm_last_abort)
+    int why;
+    const void* why_address;
+    tx_t why_owner;
+    /// @brief TL2 state
+    Tl2Tx tl2;
+    /// @brief place of the thread in the queue for the turn of a batcher
+    QNode queue;
+    #ifdef _TO_USE_STATS_
+    /// @brief counters of this thread, on a line of their own
+    TxStats stats;
+    #endif
+    #ifdef _TO_USE_TRACE_
+    /// @brief TRACE_RING events, allocated on the first one, and how many were ever
+    /// recorded (only the thread writes either)
+    TraceEvent* trace;
+    atomic_ulong trace_count;
+    /// @brief time stamp counter when the transaction began
+    ulong trace_begin;
+    #endif
+    #if TM_LOG_LEVEL > LOG_OFF
+    /// @brief LOG_RING log records, allocated on the first one; the thread bumps head
+    /// and dropped, the thread writing them out (see log_drain) bumps tail and seen
+    LogRecord* log_ring;
+    atomic_ulong log_head;
+    atomic_ulong log_tail;
+    atomic_ulong log_dropped;
+    ulong log_dropped_seen;
+    #endif
+    #ifdef _TO_USE_HEATMAP_
+    /// @brief conflicts left to skip before the next one gets recorded
+    ulong heat_skip;
+    #endif
+    /// @brief reclamation clock read when the transaction began, 0 between transactions
+    atomic_ulong announce;
+    /// @brief contention manager: the writer id of the transaction and CM_RUNNING,
+    /// CM_DOOMED (by an older or busier transaction) or CM_DONE, and the priority kept
+    /// over the retries of a transaction (read by the others, see cm_wins)
+    atomic_ulong cm_state;
+    atomic_ulong cm_birth;
+    atomic_ulong cm_karma;
+    ulong cm_seed;
+    /// @brief segment pool blocks cached by this thread, per size class
+    SegMag mags[POOL_CLASSES];
+    /// @brief next descriptor in the pool's free list
+    struct TxDesc_str* next_free;
+    /// @brief next descriptor ever made, to walk all of them
+    struct TxDesc_str* next_all;
+};
+typedef struct TxDesc_str TxDesc;
+
 struct Region_str {
     Segment* start; 
     // void* start;
-    Segment* allocs;
+    /// @brief only used for iteration, lookups go through index; pushed to
+    /// lock-free, unlinked by one thread at a time (see seglist_sweep)
+    _Atomic(Segment*) allocs;
+    /// @brief segment id -> segment, in pages of SEG_PAGE slots; NULL if the page is
+    /// not allocated yet or the slot is free
+    _Atomic(_Atomic(Segment*)*) index[SEG_PAGES];
+    /// @brief where to start looking for a free slot in index
+    atomic_ulong index_hint;
     size_t size;
     size_t align;
+    /// @brief bytes covered by a control word, a power of two from align up to a line
+    size_t stripe;
 
     Batcher *batcher;
+    /// @brief deleted segments a running transaction may still be reading, newest first
+    Segment* limbo;
+    #ifdef _TO_USE_MVCC_
+    /// @brief versions in the chains, oldest first, and the first one not stamped yet
+    /// (only touched by the committing thread)
+    Version* mv_live;
+    Version* mv_live_tail;
+    Version* mv_fresh;
+    /// @brief versions out of the chains, newest first, freed once no reader can hold them
+    Version* mv_dead;
+    /// @brief snapshots older than this cannot be served (a version could not be allocated)
+    atomic_ulong mv_floor;
+    #endif
+    #ifdef _TO_USE_HEATMAP_
+    /// @brief conflicts sampled per stripe, NULL if it could not be allocated
+    Heat* heat;
+    #endif
+
+    /// @brief which engine runs the transactions, TM_ENGINE_* in tm_ext.h
+    int engine;
+    /// @brief how the segments are laid out, TM_LAYOUT_* in tm_ext.h
+    int layout;
+    /// @brief contention manager, TM_CM_* in tm_ext.h
+    int cm;
+    /// @brief TL2 global version clock
+    atomic_ulong clock;
     struct shared_lock_t lock;
     // TBD
 };
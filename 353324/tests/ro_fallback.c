@@ -0,0 +1,53 @@
+// A read-only transaction that aborted ro_retry_max times in a row joins the
+// epoch instead of reading a snapshot (see tm_begin). It must still commit.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <tm.h>
+
+#define RO_ABORTS 16 // more than ro_retry_max
+
+static int check(bool ok, const char* what) {
+    if (!ok)
+        fprintf(stderr, "ro_fallback: %s\n", what);
+    return ok ? 0 : 1;
+}
+
+int main(void) {
+    shared_t shared = tm_create(64, 8);
+    if (shared == invalid_shared)
+        return check(false, "tm_create failed");
+    int failed = check(tm_size(shared) == 64, "tm_size is not the size given to tm_create");
+    void* start = tm_start(shared);
+
+    uint64_t val = 42;
+    tx_t tx = tm_begin(shared, false);
+    failed |= check(tx != invalid_tx, "tm_begin (read-write) failed");
+    failed |= check(tm_write(shared, tx, &val, sizeof(val), start), "tm_write failed");
+    failed |= check(tm_end(shared, tx), "the read-write transaction did not commit");
+
+    // no segment there: every read aborts the transaction
+    void* unmapped = (void*)((uintptr_t)5 << 48);
+    for (int i = 0; i < RO_ABORTS; ++i) {
+        tx = tm_begin(shared, true);
+        failed |= check(tx != invalid_tx, "tm_begin (read-only) failed");
+        failed |= check(!tm_read(shared, tx, unmapped, sizeof(val), &val), "read of an unmapped address succeeded");
+    }
+
+    // in the epoch now, and then back to snapshots
+    for (int i = 0; i < 2; ++i) {
+        val = 0;
+        tx = tm_begin(shared, true);
+        failed |= check(tx != invalid_tx, "tm_begin (read-only) failed");
+        failed |= check(tm_read(shared, tx, start, sizeof(val), &val), "read of the start segment failed");
+        failed |= check(val == 42, "read the wrong value");
+        failed |= check(tm_end(shared, tx), "the read-only transaction did not commit");
+    }
+
+    tm_destroy(shared);
+    if (!failed)
+        printf("ro_fallback: ok\n");
+    return failed;
+}
@@ -0,0 +1,411 @@
+#ifndef _TL2_H_
+#define _TL2_H_
+
+// TL2: a global version clock, one versioned lock per word, writes buffered
+// until commit, reads validated against the clock. Shares segments, the
+// index and tm.h with the batcher; selected per region (see tm_create).
+
+#include <string.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include "structs.h"
+#include "desc_func.h"
+#include "batcher_func.h"
+#include "macros.h"
+#include "Mytm.h"
+
+// A versioned lock holds (version << 1) when free, (owner descriptor | 1) when locked.
+static inline bool vlock_locked(ulong v) { return v & 1; }
+static inline ulong vlock_version(ulong v) { return v >> 1; }
+
+/** Versioned lock of the word at the given offset, it takes the place of the control word.
+ * @param seg    Segment of the word
+ * @param offset Offset of the word in the segment
+ * @param align  Size of a word
+ * @return Versioned lock of the word
+**/
+static inline atomic_ulong* tl2_vlock(const Segment* seg, size_t offset, size_t align) {
+    return word_control(seg, offset, align);
+}
+
+static inline ulong tl2_owned(const Tl2Tx* tx) { return (ulong)(uintptr_t)tx | 1; }
+
+/** Transaction holding a versioned lock, invalid_tx if it is free.
+**/
+static inline tx_t tl2_lock_owner(ulong v) {
+    return vlock_locked(v) ? (tx_t)desc_of_tl2((Tl2Tx*)(uintptr_t)(v & ~1ul)) : invalid_tx;
+}
+
+/** Note why the transaction is about to roll back, see desc_abort_why.
+ * @param v Versioned lock of the word, the owner is known if it is locked
+**/
+static inline void tl2_abort_why(Tl2Tx* tx, int why, const Segment* seg, size_t offset, ulong v) {
+    desc_abort_why(desc_of_tl2(tx), why, (const uint8_t*)seg_vaddr(seg) + offset, tl2_lock_owner(v));
+}
+
+/** Grow a dynamic array so that it holds at least need elements.
+ * @return Whether there is room
+**/
+static inline bool tl2_grow(void** array, size_t* cap, size_t need, size_t elem) {
+    if (likely(need <= *cap))
+        return true;
+    size_t capacity = *cap ? *cap : 16;
+    while (capacity < need)
+        capacity *= 2;
+    void* grown = realloc(*array, capacity * elem);
+    if (unlikely(!grown))
+        return false;
+    *array = grown;
+    *cap = capacity;
+    return true;
+}
+
+static inline size_t tl2_hash(const atomic_ulong* lock, size_t cap) {
+    return (size_t)(((uintptr_t)lock >> 3) * 0x9E3779B97F4A7C15ul) & (cap - 1);
+}
+
+/** Find the write set entry of a word.
+ * @return Entry, NULL if the word was not written
+**/
+static inline Tl2Write* tl2_lookup(Tl2Tx* tx, const atomic_ulong* lock) {
+    if (tx -> nb_writes == 0)
+        return NULL;
+    for (size_t slot = tl2_hash(lock, tx -> cap_table); tx -> table[slot] != 0; slot = (slot + 1) & (tx -> cap_table - 1)) {
+        Tl2Write* write = tx -> writes + tx -> table[slot] - 1;
+        if (write -> lock == lock)
+            return write;
+    }
+    return NULL;
+}
+
+static inline void tl2_table_put(Tl2Tx* tx, size_t index) {
+    Tl2Write* write = tx -> writes + index;
+    size_t slot = tl2_hash(write -> lock, tx -> cap_table);
+    while (tx -> table[slot] != 0)
+        slot = (slot + 1) & (tx -> cap_table - 1);
+    tx -> table[slot] = index + 1;
+    write -> slot = slot;
+}
+
+/** Add a word to the write set (it must not be there yet).
+ * @return Entry, NULL if out of memory
+**/
+static inline Tl2Write* tl2_add_write(Tl2Tx* tx, Segment* seg, size_t offset, atomic_ulong* lock, size_t align) {
+    size_t need = tx -> nb_writes + 1;
+    size_t cap_writes = tx -> cap_writes;
+    if (unlikely(!tl2_grow((void**)&(tx -> writes), &(tx -> cap_writes), need, sizeof(Tl2Write))))
+        return NULL;
+    if (tx -> cap_writes != cap_writes) {
+        Word* values = (Word*)realloc(tx -> values, tx -> cap_writes * align * sizeof(Word));
+        if (unlikely(!values))
+            return NULL;
+        tx -> values = values;
+    }
+    // keep the table at most half full
+    if (2 * need > tx -> cap_table) {
+        size_t cap = tx -> cap_table ? tx -> cap_table * 2 : 32;
+        size_t* table = (size_t*)calloc(cap, sizeof(size_t));
+        if (unlikely(!table))
+            return NULL;
+        free(tx -> table);
+        tx -> table = table;
+        tx -> cap_table = cap;
+        for (size_t i = 0; i < tx -> nb_writes; ++i)
+            tl2_table_put(tx, i);
+    }
+    Tl2Write* write = tx -> writes + tx -> nb_writes;
+    write -> seg = seg;
+    write -> offset = offset;
+    write -> lock = lock;
+    write -> has_value = true;
+    tl2_table_put(tx, tx -> nb_writes++);
+    return write;
+}
+
+static inline Word* tl2_value(const Tl2Tx* tx, const Tl2Write* write, size_t align) {
+    return tx -> values + (size_t)(write - tx -> writes) * align;
+}
+
+/** Forget everything about the transaction on this thread.
+**/
+static inline void tl2_reset(Tl2Tx* tx) {
+    for (size_t i = 0; i < tx -> nb_writes; ++i)
+        tx -> table[tx -> writes[i].slot] = 0;
+    tx -> nb_writes = 0;
+    tx -> nb_reads = 0;
+    txlog_clear(&(tx -> segs));
+}
+
+/** Unlink and retire the dead segments, region -> lock makes us the only sweeper.
+**/
+static inline void tl2_sweep(Region* region) {
+    shared_lock_acquire(&(region -> lock));
+    seglist_sweep(region);
+    shared_lock_release(&(region -> lock));
+}
+
+/** Reclaim the freed segments no running transaction can reference any more.
+ * @param region Shared memory region
+**/
+static inline void tl2_limbo_release(Region* region) {
+    if (region -> limbo == NULL)
+        return;
+    shared_lock_acquire(&(region -> lock));
+    limbo_release(region);
+    shared_lock_release(&(region -> lock));
+}
+
+/** Begin a transaction.
+ * @param region Shared memory region
+ * @param tx     TL2 state of the descriptor of the thread
+ * @param is_ro  Whether the transaction is read-only
+**/
+static inline void tl2_begin(Region* region, Tl2Tx* tx, bool is_ro) {
+    tx -> is_ro = is_ro;
+    tx -> rv = atomic_load(&(region -> clock));
+}
+
+/** Abort: drop the buffered writes and the segments we allocated.
+ * @param region Shared memory region
+ * @param tx     Transaction to abort
+**/
+static inline void tl2_abort(Region* region, Tl2Tx* tx) {
+    bool swept = false;
+    for (size_t n = 0; n < tx -> segs.size; ++n) {
+        Access* access = tx -> segs.entries + n;
+        if (access -> kind != access_alloc)
+            continue;
+        // nobody else should know its address, it goes through the limbo all the same
+        atomic_store(&(access -> seg -> to_delete), true);
+        atomic_store(&(access -> seg -> dead), true);
+        swept = true;
+    }
+    if (swept)
+        tl2_sweep(region);
+    tl2_reset(tx);
+    desc_done(desc_of_tl2(tx), false);
+}
+
+static inline bool tl2_read(Region* region, Tl2Tx* tx, void const* source, size_t size, void* target) {
+    Segment* seg = findSegment(region, source);
+    if (unlikely(seg == NULL)) {
+        desc_abort_why(desc_of_tl2(tx), TM_ABORT_NO_SEGMENT, source, invalid_tx);
+        tl2_abort(region, tx);
+        return false;
+    }
+
+    size_t align = region -> align;
+    size_t offset = seg_offset(source);
+    for (size_t i = 0; i < size; i += align) {
+        atomic_ulong* lock = tl2_vlock(seg, offset + i, align);
+
+        // read our own write
+        Tl2Write* write = tl2_lookup(tx, lock);
+        if (write != NULL) {
+            memcpy((Word*)target + i, tl2_value(tx, write, align), align);
+            continue;
+        }
+
+        ulong v1 = atomic_load(lock);
+        if (vlock_locked(v1) || vlock_version(v1) > tx -> rv || atomic_load(&(seg -> to_delete))) {
+            tl2_abort_why(tx, vlock_locked(v1) ? TM_ABORT_READ_WRITE : vlock_version(v1) > tx -> rv
+                          ? TM_ABORT_VALIDATION : TM_ABORT_NO_SEGMENT, seg, offset + i, v1);
+            tl2_abort(region, tx);
+            return false;
+        }
+        memcpy((Word*)target + i, word_data(seg, offset + i), align);
+        atomic_thread_fence(memory_order_acquire);
+        ulong v2 = atomic_load_explicit(lock, memory_order_relaxed);
+        if (v2 != v1) {
+            tl2_abort_why(tx, vlock_locked(v2) ? TM_ABORT_READ_WRITE : TM_ABORT_VALIDATION, seg, offset + i, v2);
+            tl2_abort(region, tx);
+            return false;
+        }
+
+        if (!tx -> is_ro) {
+            if (unlikely(!tl2_grow((void**)&(tx -> reads), &(tx -> cap_reads), tx -> nb_reads + 1, sizeof(atomic_ulong*)))) {
+                tl2_abort_why(tx, TM_ABORT_NOMEM, seg, offset + i, 0);
+                tl2_abort(region, tx);
+                return false;
+            }
+            tx -> reads[tx -> nb_reads++] = lock;
+        }
+    }
+    return true;
+}
+
+static inline bool tl2_write(Region* region, Tl2Tx* tx, void const* source, size_t size, void* target) {
+    Segment* seg = findSegment(region, target);
+    if (unlikely(seg == NULL)) {
+        desc_abort_why(desc_of_tl2(tx), TM_ABORT_NO_SEGMENT, target, invalid_tx);
+        tl2_abort(region, tx);
+        return false;
+    }
+
+    size_t align = region -> align;
+    size_t offset = seg_offset(target);
+    for (size_t i = 0; i < size; i += align) {
+        atomic_ulong* lock = tl2_vlock(seg, offset + i, align);
+        Tl2Write* write = tl2_lookup(tx, lock);
+        if (write == NULL)
+            write = tl2_add_write(tx, seg, offset + i, lock, align);
+        if (unlikely(write == NULL)) {
+            tl2_abort_why(tx, TM_ABORT_NOMEM, seg, offset + i, 0);
+            tl2_abort(region, tx);
+            return false;
+        }
+        memcpy(tl2_value(tx, write, align), (Word const*)source + i, align);
+    }
+    return true;
+}
+
+static inline alloc_t tl2_alloc(Region* region, Tl2Tx* tx, size_t size, void** target) {
+    if (unlikely(!txlog_reserve(&(tx -> segs))))
+        return nomem_alloc;
+
+    Segment* seg = Segment_alloc(size, region -> align, region -> stripe, region -> layout);
+    if (unlikely(!seg))
+        return nomem_alloc;
+    if (unlikely(!index_insert(region, seg))) {
+        Segment_free(seg);
+        return nomem_alloc;
+    }
+    seglist_push(region, seg);
+
+    txlog_push(&(tx -> segs), seg, 0, access_alloc);
+    *target = seg_vaddr(seg);
+    return success_alloc;
+}
+
+static inline bool tl2_free(Region* region, Tl2Tx* tx, void* target) {
+    Segment* seg = findSegment(region, target);
+    int why = seg == NULL ? TM_ABORT_NO_SEGMENT : seg == region -> start ? TM_ABORT_FREE : TM_ABORT_NONE;
+    if (why == TM_ABORT_NONE && unlikely(!txlog_reserve(&(tx -> segs))))
+        why = TM_ABORT_NOMEM;
+    if (unlikely(why != TM_ABORT_NONE)) {
+        desc_abort_why(desc_of_tl2(tx), why, target, invalid_tx);
+        tl2_abort(region, tx);
+        return false;
+    }
+    // its words get locked at commit
+    txlog_push(&(tx -> segs), seg, 0, access_free);
+    return true;
+}
+
+/** Release the locks taken so far at commit, putting back their old version.
+**/
+static inline void tl2_unlock(Tl2Tx* tx, size_t nb_locked) {
+    for (size_t i = 0; i < nb_locked; ++i)
+        atomic_store(tx -> writes[i].lock, tx -> writes[i].old << 1);
+}
+
+static inline bool tl2_end(Region* region, Tl2Tx* tx) {
+    size_t align = region -> align;
+
+    if (tx -> is_ro || (tx -> nb_writes == 0 && tx -> segs.size == 0)) {
+        tl2_reset(tx);
+        desc_done(desc_of_tl2(tx), true);
+        return true;
+    }
+
+    // the words of the freed segments are locked too, to bump their version
+    for (size_t n = 0; n < tx -> segs.size; ++n) {
+        Access* access = tx -> segs.entries + n;
+        if (access -> kind != access_free)
+            continue;
+        Segment* seg = access -> seg;
+        for (size_t offset = 0; offset < seg -> size; offset += align) {
+            atomic_ulong* lock = tl2_vlock(seg, offset, align);
+            if (tl2_lookup(tx, lock) != NULL)
+                continue;
+            Tl2Write* write = tl2_add_write(tx, seg, offset, lock, align);
+            if (unlikely(write == NULL)) {
+                tl2_abort_why(tx, TM_ABORT_NOMEM, seg, offset, 0);
+                tl2_abort(region, tx);
+                return false;
+            }
+            write -> has_value = false;
+        }
+    }
+
+    // lock the write set, give up on the first word someone else holds
+    ulong owned = tl2_owned(tx);
+    for (size_t i = 0; i < tx -> nb_writes; ++i) {
+        Tl2Write* write = tx -> writes + i;
+        ulong v = atomic_load(write -> lock);
+        if (vlock_locked(v) || !atomic_compare_exchange_strong(write -> lock, &v, owned)) {
+            tl2_abort_why(tx, TM_ABORT_WRITE_WRITE, write -> seg, write -> offset, v);
+            tl2_unlock(tx, i);
+            tl2_abort(region, tx);
+            return false;
+        }
+        write -> old = vlock_version(v);
+        // someone freed the segment before we got the word
+        if (atomic_load(&(write -> seg -> to_delete))) {
+            tl2_abort_why(tx, write -> has_value ? TM_ABORT_NO_SEGMENT : TM_ABORT_FREE, write -> seg, write -> offset, 0);
+            tl2_unlock(tx, i + 1);
+            tl2_abort(region, tx);
+            return false;
+        }
+    }
+
+    ulong wv = atomic_fetch_add(&(region -> clock), 1) + 1;
+
+    // nobody committed since we began: what we read is still what we would read now
+    if (wv != tx -> rv + 1) {
+        for (size_t i = 0; i < tx -> nb_reads; ++i) {
+            ulong v = atomic_load(tx -> reads[i]);
+            if (v == owned) {
+                Tl2Write* write = tl2_lookup(tx, tx -> reads[i]);
+                v = write -> old << 1;
+            }
+            if (vlock_locked(v) || vlock_version(v) > tx -> rv) {
+                desc_abort_why(desc_of_tl2(tx), vlock_locked(v) ? TM_ABORT_READ_WRITE : TM_ABORT_VALIDATION,
+                               NULL, tl2_lock_owner(v));
+                tl2_unlock(tx, tx -> nb_writes);
+                tl2_abort(region, tx);
+                return false;
+            }
+        }
+    }
+
+    // write back
+    TxDesc* desc = desc_of_tl2(tx);
+    for (size_t i = 0; i < tx -> nb_writes; ++i) {
+        Tl2Write* write = tx -> writes + i;
+        if (write -> has_value) {
+            memcpy(word_data(write -> seg, write -> offset), tl2_value(tx, write, align), align);
+            desc_stat(desc, commit_bytes, align);
+        }
+    }
+
+    // the freed segments go to the limbo, their index slot stays taken so that
+    // a transaction holding an old address finds nothing there and aborts
+    bool swept = false;
+    for (size_t n = 0; n < tx -> segs.size; ++n) {
+        Access* access = tx -> segs.entries + n;
+        desc_stat(desc, seg_allocs, access -> kind == access_alloc);
+        if (access -> kind != access_free)
+            continue;
+        Segment* seg = access -> seg;
+        if (atomic_exchange(&(seg -> to_delete), true))
+            continue;
+        atomic_store(&(seg -> dead), true);
+        desc_stat(desc, seg_frees, 1);
+        swept = true;
+    }
+    if (swept)
+        tl2_sweep(region);
+
+    // release with the new version
+    for (size_t i = 0; i < tx -> nb_writes; ++i)
+        atomic_store(tx -> writes[i].lock, wv << 1);
+
+    tl2_reset(tx);
+    desc_done(desc, true);
+    tl2_limbo_release(region);
+    return true;
+}
+
+#endif
@@ -19,8 +19,28 @@
 #endif
 
 #define _TO_USE_BATCHER_ 
+// each word keeps two copies and a bit telling which one is readable,
+// commit flips the bit instead of copying shadow to data
+// #define _TO_USE_DUAL_COPY_
 // #define _DEBUG_FLZ_ 
 
+// engine of the regions when TM_ENGINE is not set, e.g. -DTM_ENGINE_DEFAULT=TM_ENGINE_TL2
+#ifndef TM_ENGINE_DEFAULT
+#define TM_ENGINE_DEFAULT TM_ENGINE_BATCHER
+#endif
+// layout of the segments when TM_LAYOUT is not set, e.g. -DTM_LAYOUT_DEFAULT=TM_LAYOUT_INTERLEAVED
+#ifndef TM_LAYOUT_DEFAULT
+#define TM_LAYOUT_DEFAULT TM_LAYOUT_SPLIT
+#endif
+// bytes covered by a control word when TM_STRIPE is not set, 0 for one word, e.g. -DTM_STRIPE_DEFAULT=32
+#ifndef TM_STRIPE_DEFAULT
+#define TM_STRIPE_DEFAULT 0
+#endif
+// contention manager when TM_CM is not set, e.g. -DTM_CM_DEFAULT=TM_CM_BACKOFF
+#ifndef TM_CM_DEFAULT
+#define TM_CM_DEFAULT TM_CM_ABORT
+#endif
+
 // External headers
 #include <stddef.h>
 #include <stdlib.h>
@@ -32,7 +52,15 @@
 #include "Mytm.h"
 
 #include "structs.h"
+#include "desc_func.h"
 #include "batcher_func.h"
+#include "tl2_func.h"
+#include "mvcc_func.h"
+#include "cm_func.h"
+#include "trace_func.h"
+#include "log_func.h"
+#include "heat_func.h"
+#include "tm_ext.h"
 #include "macros.h"
 #include "shared-lock.h"
 
@@ -44,10 +72,6 @@
 
 shared_t tm_create(size_t size, size_t align) {
 
-    #ifdef _DEBUG_FLZ_
-    // printf("STARTING my CREATE\n\n");
-    #endif 
-
     // printf("align: %lu\n", align);
 
     align = align < sizeof(void*) ? sizeof(void*) : align;
@@ -61,50 +85,127 @@ shared_t tm_create(size_t size, size_t align) {
     }
 
 
+    // pick the engine
+    region -> engine = TM_ENGINE_DEFAULT;
+    char const* engine = getenv("TM_ENGINE");
+    if (engine != NULL && strcmp(engine, "tl2") == 0)
+        region -> engine = TM_ENGINE_TL2;
+    else if (engine != NULL && strcmp(engine, "batcher") == 0)
+        region -> engine = TM_ENGINE_BATCHER;
+
     // alloc the start
-    if (unlikely(posix_memalign((void**)&region -> start, align, sizeof(Segment) 
-                                                     + sizeof(char) * size
-                                                     + sizeof(Word) * size * 2) != 0)) 
+    // pick the layout of the segments
+    region -> layout = TM_LAYOUT_DEFAULT;
+    char const* layout = getenv("TM_LAYOUT");
+    if (layout != NULL && strcmp(layout, "interleaved") == 0)
+        region -> layout = TM_LAYOUT_INTERLEAVED;
+    else if (layout != NULL && strcmp(layout, "split") == 0)
+        region -> layout = TM_LAYOUT_SPLIT;
+
+    // pick the contention manager
+    region -> cm = TM_CM_DEFAULT;
+    char const* cm = getenv("TM_CM");
+    if (cm != NULL && strcmp(cm, "abort") == 0)
+        region -> cm = TM_CM_ABORT;
+    else if (cm != NULL && strcmp(cm, "backoff") == 0)
+        region -> cm = TM_CM_BACKOFF;
+    else if (cm != NULL && strcmp(cm, "timestamp") == 0)
+        region -> cm = TM_CM_TIMESTAMP;
+    else if (cm != NULL && strcmp(cm, "karma") == 0)
+        region -> cm = TM_CM_KARMA;
+
+    // pick the stripe covered by a control word, a power of two from a word up to a line
+    // (a TL2 write set keeps one versioned lock per word)
+    size_t stripe = TM_STRIPE_DEFAULT;
+    char const* stripe_env = getenv("TM_STRIPE");
+    if (stripe_env != NULL)
+        stripe = strtoul(stripe_env, NULL, 10);
+    size_t line = line_bytes(align);
+    if (stripe < align || region -> engine == TM_ENGINE_TL2)
+        stripe = align;
+    else if (stripe > line)
+        stripe = line;
+    region -> stripe = (size_t)1 << (63 - __builtin_clzl(stripe));
+
+    region -> start = Segment_alloc(size, align, region -> stripe, region -> layout);
+    if (unlikely(!region -> start)) 
     {
         free(region);
         return invalid_shared;
     }
 
-    memset(region -> start, 0, sizeof(Segment) 
-                   + sizeof(char) * size 
-                   + sizeof(Word) * size * 2 );
-
-    region -> start -> data    =      (Word*)((uintptr_t)region -> start + sizeof(Segment));
-    region -> start -> shadow  =      (Word*)((uintptr_t)region -> start -> data + sizeof(Word) * size);
-    region -> start -> control = (atomic_tx*)((uintptr_t)region -> start -> shadow + sizeof(Word) * size);
-    // memset(seg -> data, 0, size * sizeof(Word));
-
     // add creator and size
     atomic_store(&(region -> start -> creator), it_is_free);
-    region -> start -> size = size;
 
-    region -> align = align;
     region -> size = size;
-    region -> allocs = NULL; 
+    region -> align = align;
+    atomic_init(&(region -> allocs), NULL);
+
+    // register the start segment in the index
+    for (ulong page = 0; page < SEG_PAGES; ++page)
+        atomic_init(&(region -> index[page]), NULL);
+    if (unlikely(index_page(region, start_seg_id >> SEG_PAGE_SHIFT, true) == NULL)) {
+        Segment_free(region -> start);
+        free(region);
+        return invalid_shared;
+    }
+    region -> start -> id = start_seg_id;
+    atomic_store(index_slot(region, start_seg_id), region -> start);
+    atomic_init(&(region -> index_hint), start_seg_id);
 
     if (!shared_lock_init(&(region->lock))) {
-        free(region->start);
+        free(region -> index[start_seg_id >> SEG_PAGE_SHIFT]);
+        Segment_free(region->start);
         free(region);
         return invalid_shared;
     }
 
     // TODO: create Batcher
-    region -> batcher = (Batcher*)malloc(sizeof(Batcher));
-    atomic_store(&(region -> batcher -> timestamp), 0);
-    atomic_store(&(region -> batcher -> next), 0);
+    // aligned so that each group of hot fields gets its own cache line
+    region -> batcher = (Batcher*)aligned_alloc(CACHE_LINE, sizeof(Batcher));
+    if (unlikely(!region -> batcher)) {
+        shared_lock_cleanup(&(region->lock));
+        free(region -> index[start_seg_id >> SEG_PAGE_SHIFT]);
+        Segment_free(region->start);
+        free(region);
+        return invalid_shared;
+    }
+    atomic_init(&(region -> batcher -> tail), NULL);
     atomic_store(&(region -> batcher -> cnt_thread), 0);
     atomic_store(&(region -> batcher -> cnt_epoch), 0);
     atomic_store(&(region -> batcher -> is_writing), false);
-    atomic_store(&(region -> batcher -> res_writes), batch_size);
-
-    #ifdef _DEBUG_FLZ_
-    printf("END CREATE for MY\n");
+    atomic_store(&(region -> batcher -> res_writes), epoch_size_init);
+    atomic_init(&(region -> batcher -> epoch_size), epoch_size_init);
+    atomic_init(&(region -> batcher -> epoch_aborts), 0);
+    atomic_init(&(region -> batcher -> cm_kills), 0);
+    for (ulong id = 0; id <= epoch_size_max; ++id)
+        atomic_init(&(region -> batcher -> owners[id]), NULL);
+    atomic_init(&(region -> batcher -> epoch_waiting), 0);
+    atomic_init(&(region -> batcher -> avg_abort_permille), 0);
+    atomic_init(&(region -> batcher -> avg_commit_ns), 0);
+    atomic_init(&(region -> batcher -> avg_epoch_ns), 0);
+    region -> batcher -> epoch_start_ns = now_ns();
+    atomic_init(&(region -> batcher -> logs), NULL);
+    atomic_init(&(region -> batcher -> commit_seq), 0);
+    region -> limbo = NULL;
+    #ifdef _TO_USE_MVCC_
+    region -> mv_live = NULL;
+    region -> mv_live_tail = NULL;
+    region -> mv_fresh = NULL;
+    region -> mv_dead = NULL;
+    atomic_init(&(region -> mv_floor), 0);
+    #endif
+    #ifdef _TO_USE_HEATMAP_
+    // sample one conflict of a thread out of TM_HEAT_PERIOD
+    char const* period = getenv("TM_HEAT_PERIOD");
+    region -> heat = heat_create(period != NULL ? strtoul(period, NULL, 10) : HEAT_PERIOD_DEFAULT);
     #endif
+
+    atomic_init(&(region -> clock), 0);
+    wp_init(&(region -> batcher -> epoch_wp));
+
+    log_info("tm_create: region %p, %zu bytes aligned on %zu, engine %d, stripe %zu",
+             (void*)region, size, align, region -> engine, region -> stripe);
     return region; 
 }
 
@@ -112,24 +213,39 @@ shared_t tm_create(size_t size, size_t align) {
  * @param shared Shared memory region to destroy, with no running transaction
 **/
 void tm_destroy(shared_t shared) {
-    #ifdef _DEBUG_FLZ_
-    printf("STARTING my DESTROY\n\n");
-    #endif 
     Region *region = (Region*)shared;
+    log_info("tm_destroy: region %p", (void*)region);
+
+    #ifdef _TO_USE_HEATMAP_
+    char const* report = getenv("TM_HEAT_REPORT");
+    if (report != NULL)
+        heat_report(region -> heat, strtoul(report, NULL, 10));
+    free(region -> heat);
+    #endif
 
     while(region -> allocs != NULL) {
         Segment* tmp = region -> allocs;
-        region -> allocs = region -> allocs -> next;
+        region -> allocs = tmp -> next;
         // free(tmp -> data);
-        free(tmp);
+        Segment_free(tmp);
     }
+    while(region -> limbo != NULL) {
+        Segment* tmp = region -> limbo;
+        region -> limbo = tmp -> retired_next;
+        Segment_free(tmp);
+    }
+    #ifdef _TO_USE_MVCC_
+    mvcc_destroy(region);
+    #endif
 
     // ==============================
     shared_lock_cleanup(&(region->lock));
     // ==============================
 
     free(region -> batcher);
-    free(region -> start);
+    Segment_free(region -> start);
+    for (ulong page = 0; page < SEG_PAGES; ++page)
+        free(region -> index[page]);
     free(region);
 }
 
@@ -139,7 +255,7 @@ void tm_destroy(shared_t shared) {
 **/
 void* tm_start(shared_t unused(shared)) {
     Region *region = (Region*)shared;
-    return region -> start -> data;
+    return seg_vaddr(region -> start);
 }
 
 /** [thread-safe] Return the size (in bytes) of the first allocated segment of the shared memory region.
@@ -166,17 +282,27 @@ size_t tm_align(shared_t unused(shared)) {
  * @return Opaque transaction ID, 'invalid_tx' on failure
 **/
 tx_t tm_begin(shared_t shared, bool is_ro){
-        #ifdef _DEBUG_FLZ_
-        if (is_ro) {
-            printf("RORORORORORO!!!!!\n"); 
-            // return ;
-        }
-
-        printf("======\ntm_begin\n");
-        #endif
+    log_trace("tm_begin: %s", is_ro ? "read-only" : "read-write");
 
     Region *region = (Region*)shared;
 
+    // allocated on the first transaction of the thread only
+    TxDesc* desc = desc_get();
+    if (unlikely(desc == NULL))
+        return invalid_tx;
+    trace_tx_begin(desc);
+    desc -> is_ro = is_ro;
+    // back off (if the region says so) before holding anything up
+    if (!is_ro)
+        cm_begin(region, desc);
+    // from now on, no segment we may look up gets reclaimed
+    ebr_enter(desc);
+
+    if (region -> engine == TM_ENGINE_TL2) {
+        tl2_begin(region, &(desc -> tl2), is_ro);
+        return (tx_t)desc;
+    }
+
     #ifdef _TO_USE_BATCHER_
     Batcher *batcher = region -> batcher;
     #endif
@@ -186,70 +312,68 @@ tx_t tm_begin(shared_t shared, bool is_ro){
         
         #ifdef _TO_USE_BATCHER_
 
-        tx_t process_idx = atomic_fetch_add(&(batcher->timestamp), 1);
-
-            #ifdef _DEBUG_FLZ_
-                printf("tm_begin: is_ro, process: %lu (and the ts now is: %lu) \n", process_idx, atomic_load(&(batcher->timestamp)));
-                printf("current next: %lu\n", atomic_load(&(batcher->next)));
-            #endif
+        // read the last committed state, no ticket, not part of the epoch
+        if (likely(desc -> ro_retries < ro_retry_max)) {
+            snapshot_begin(batcher, desc);
+            desc -> id = read_only_tx;
+            return (tx_t)desc;
+        }
 
-        while (process_idx != atomic_load(&(batcher->next)))
-            sched_yield();
+        // too many aborts in a row (e.g. a long scan under many commits),
+        // join the epoch so that nothing can be committed under us
+        turn_take(batcher, desc);
 
-        atomic_fetch_add(&(batcher->cnt_thread), 1);
-        atomic_fetch_add(&(batcher->next), 1);
+        held_add(&(batcher->cnt_thread), 1);
+        ticket_pass(batcher, &(desc -> queue));
 
-        return read_only_tx;
+        desc -> id = read_only_epoch_tx;
+        return (tx_t)desc;
 
         #endif
 
         // ==============================
         // ==== reference implementation
         if (unlikely(!shared_lock_acquire_shared(&(region ->lock)))){
-            printf("tm_begin: is_ro: failed\n");
+            log_error("tm_begin: is_ro: failed");
             return invalid_tx;
         }
-        return read_only_tx;
+        desc -> id = read_only_tx;
+        return (tx_t)desc;
     } 
 
     #ifdef _TO_USE_BATCHER_
 
+    tx_t tx_idx;
     while(true) {
-        tx_t process_idx = atomic_fetch_add(&(batcher->timestamp), 1);
+        turn_take(batcher, desc);
 
-            #ifdef _DEBUG_FLZ_
-            printf("tm_begin: is_rw, process: %lu (and the ts now is: %lu) \n", process_idx, atomic_load(&(batcher->timestamp)));
-            printf("current next: %lu\n", atomic_load(&(batcher->next)));
-            #endif
-
-
-        while (process_idx != atomic_load(&(batcher->next)))
-            sched_yield();
-
-        if (atomic_load(&(batcher->res_writes)) != 0) 
+        ulong slots = atomic_load(&(batcher->res_writes));
+        if (slots != 0) 
         {
-            // printf("tm_begin: is_rw, process: %lu\n\t\t: res_writes: %lu\n", process_idx, atomic_load(&(batcher->res_writes)));
-            atomic_fetch_add(&(batcher->res_writes), -1)
-            ;
-            // );
+            held_add(&(batcher->res_writes), -1);
+            // writers get 1, 2, ... in the order they enter the epoch
+            tx_idx = atomic_load(&(batcher->epoch_size)) - slots + 1;
             break; 
         }
 
         // skip and wait for next epoch, process with new idx
-        atomic_fetch_add(&(batcher->next), 1);
-
+        // (read the epoch while holding the turn, it cannot move before we pass it on)
+        held_add(&(batcher->epoch_waiting), 1);
         ulong this_epoch = get_epoch(batcher);
-        while (this_epoch == get_epoch(batcher))
-            sched_yield();
+        ticket_pass(batcher, &(desc -> queue));
+
+        epoch_wait(batcher, this_epoch);
         
     } 
     
-    ulong tx_idx = atomic_fetch_add(&(batcher->cnt_thread), 1) + 1;
+    held_add(&(batcher->cnt_thread), 1);
 
-    atomic_store(&(batcher->is_writing), true);
-    atomic_fetch_add(&(batcher->next), 1);
+    atomic_store_explicit(&(batcher->is_writing), true, memory_order_relaxed);
+    ticket_pass(batcher, &(desc -> queue));
 
-    return tx_idx; 
+    desc -> id = tx_idx;
+    cm_register(batcher, desc);
+    return (tx_t)desc; 
 
     #endif
 
@@ -257,10 +381,11 @@ tx_t tm_begin(shared_t shared, bool is_ro){
     // ==== reference implementation
 
     if (unlikely(!shared_lock_acquire(&(region ->lock)))){
-        printf("tm_begin: is_rw: failed\n");
+        log_error("tm_begin: is_rw: failed");
         return invalid_tx;
     }
-    return read_write_tx;
+    desc -> id = read_write_tx;
+    return (tx_t)desc;
     // ==============================
 
     return invalid_tx;
@@ -272,77 +397,36 @@ tx_t tm_begin(shared_t shared, bool is_ro){
  * @return Whether the whole transaction committed
 **/
 bool tm_end(shared_t shared, tx_t tx) {
-        #ifdef _DEBUG_FLZ_
-        printf("tm_end\n======\n");
-        #endif
-
     Region* region = (Region*)shared;
+    TxDesc* desc = (TxDesc*)tx;
 
-    #ifdef _TO_USE_BATCHER_
-
-    Batcher *batcher = region -> batcher;
-    ulong process_idx = atomic_fetch_add(&(batcher->timestamp), 1);
-
-        #ifdef _DEBUG_FLZ_
-        printf("===\ntm_end: process_idx: %lu (and the ts now is: %lu) \n", process_idx, atomic_load(&(batcher->timestamp)));
-        printf("tm_end: next: %lu\n", atomic_load(&(batcher->next)));
-        #endif
-
-    while (process_idx != atomic_load(&(batcher->next)))
-        sched_yield();
-
-    if (atomic_fetch_add(&(batcher->cnt_thread), -1) == 1) {
-            #ifdef _DEBUG_FLZ_
-                printf("last of this epoch\n"); 
-            #endif
-        // if at the end of the epoch, do cleanup
-        if (atomic_load(&(batcher->is_writing))) {
-            // if this epoch contains some writes
-
-            Commit_seg(region, region -> start); 
-            for (Segment* seg = region -> allocs; seg != NULL; seg = seg -> next) {
-                Commit_seg(region, seg);
-            }
-
-            // and start a new epoch
-            atomic_store(&(batcher->res_writes), batch_size);
-            atomic_store(&(batcher->is_writing), false);
+    if (region -> engine == TM_ENGINE_TL2)
+        return tl2_end(region, &(desc -> tl2));
 
-            atomic_fetch_add(&(batcher->cnt_epoch), 1);
-        } else {
-
-            atomic_fetch_add(&(batcher->next), 1);
-            return true; 
-        }
-
-        atomic_fetch_add(&(batcher->next), 1);
+    #ifdef _TO_USE_BATCHER_
 
+    if (desc -> id == read_only_tx) {
+        // every read was checked against the snapshot
+        snapshot_end(region -> batcher, desc, true);
         return true;
-    } else {
-        // not the end of epoch
-        if (tx == read_only_tx) {
-            // if read-only, just return
-            // noneed to block
-            atomic_fetch_add(&(batcher->next), 1);
-            return true; 
-        } else {
-            // if is writing
-            // wait until the end of epoch 
-            // (after commit)
-            // to return
-            atomic_fetch_add(&(batcher->next), 1);
-            ulong this_epoch = get_epoch(batcher);
-            while (this_epoch == get_epoch(batcher))
-                sched_yield();
-            return true;
-        } 
     }
 
+    // only writers are registered with the contention manager and can be doomed
+    if (desc -> id != read_only_epoch_tx && unlikely(!cm_finish(desc))) {
+        // another transaction needs what we hold
+        desc_abort_why(desc, TM_ABORT_KILLED, NULL, invalid_tx);
+        Undo(region, desc);
+        return false;
+    }
+    epoch_leave(region, desc);
+    desc_done(desc, true);
+    return true;
+
     #endif
 
     // ==============================
     // ==== reference implementation
-    if (tx == read_only_tx) {
+    if (desc -> id == read_only_tx) {
         shared_lock_release_shared(&(region->lock));
     } else {
         shared_lock_release(&(region->lock));
@@ -368,62 +452,115 @@ bool tm_read(shared_t shared, tx_t tx, void const* source, size_t size, void* ta
 
     #ifdef _TO_USE_BATCHER_
     Region *region = (Region*)shared;
+    TxDesc* desc = (TxDesc*)tx;
+    trace_add(desc, trace_read, 0, size);
+
+    if (region -> engine == TM_ENGINE_TL2)
+        return tl2_read(region, &(desc -> tl2), source, size, target);
 
         // #ifdef _DEBUG_FLZ_
         // printf("tm_read: %p -> %p\n", source, target);
         // #endif
 
-    if (tx == read_only_tx) {
-        memcpy(target, source, size);
+    Segment* seg = findSegment(region, source);
+
+    if (desc -> id == read_only_tx) {
+        // the caller will not call tm_end if we fail
+        if (unlikely(seg == NULL)) {
+            desc_abort_why(desc, TM_ABORT_NO_SEGMENT, source, invalid_tx);
+            snapshot_end(region -> batcher, desc, false);
+            return false;
+        }
+        #ifdef _TO_USE_MVCC_
+        // commits do not get in the way, unless the versions we need are gone
+        if (unlikely(!mvcc_read(region, seg, seg_offset(source), size, target, desc -> ro_snapshot))) {
+            desc_abort_why(desc, TM_ABORT_SNAPSHOT, source, invalid_tx);
+            snapshot_end(region -> batcher, desc, false);
+            return false;
+        }
+        #else
+        read_committed(seg, seg_offset(source), size, target, region -> align);
+        if (unlikely(!snapshot_valid(region -> batcher, desc))) {
+            // something got committed meanwhile, what we copied may be torn
+            desc_abort_why(desc, TM_ABORT_SNAPSHOT, source, invalid_tx);
+            snapshot_end(region -> batcher, desc, false);
+            return false;
+        }
+        #endif
+        return true;
+    }
+
+    if (desc -> id == read_only_epoch_tx) {
+        if (unlikely(seg == NULL)) {
+            // leave the epoch, the caller will not call tm_end
+            desc_abort_why(desc, TM_ABORT_NO_SEGMENT, source, invalid_tx);
+            epoch_leave(region, desc);
+            desc_done(desc, false);
+            return false;
+        }
+        read_committed(seg, seg_offset(source), size, target, region -> align);
         return true;
     }
 
-    Segment* seg = findSegment(region, source);
     if (seg == NULL) {
-            #ifdef _DEBUG_FLZ_TEST_UNDO_
-            printf("tm_read: seg is NULL\n");
-            #endif
-        Undo(region, tx); 
+        log_debug("tm_read: no segment at %p", source);
+        desc_abort_why(desc, TM_ABORT_NO_SEGMENT, source, invalid_tx);
+        Undo(region, desc); 
         return false;
     }
 
+    if (cm_doomed(desc)) {
+        desc_abort_why(desc, TM_ABORT_KILLED, source, invalid_tx);
+        Undo(region, desc);
+        return false;
+    }
+    cm_worked(desc, size / region -> align);
+
+    const tx_t id = desc -> id;
     size_t cnt_word = size / sizeof(Word);
-    size_t offset = ((uintptr_t)source - (uintptr_t)seg -> data)/sizeof(Word);
+    size_t offset = seg_offset(source)/sizeof(Word);
     
-        #ifdef _DEBUG_FLZ_TEST_READ_
-        printf("tm_read: %p -> %p, offset: %lu, cnt_word: %lu\n", source, target, offset, cnt_word);
-        printf("base address of data: %p\n", seg -> data);
-        printf("base address of shadow: %p\n", seg -> shadow);
-        #endif
+    log_trace("tm_read: %p -> %p, offset: %zu, cnt_word: %zu, segment %p",
+              source, target, offset, cnt_word, (void*)seg);
 
 
-    size_t step = region -> align; 
-    for (size_t i = 0; i < cnt_word; i += step) {
-        char* control = seg -> control + offset + i;
-        char expected = it_is_free;
-        if (tx == atomic_load(control)) {
-            memcpy(((Word*) target) + i , 
-                    seg -> shadow + offset + i, 
-                    sizeof(Word) * step);
+    size_t step = region -> align;
+    if (read_own(seg, offset, cnt_word, target, id, step))
+        return true;
+    size_t stripe = seg_stripe(seg);
+    for (size_t i = 0; i < cnt_word; ) {
+        // the part of the read within the stripe of word i
+        size_t part = stripe - (offset + i - stripe_start(seg, offset + i));
+        part = part < cnt_word - i ? part : cnt_word - i;
+        atomic_ulong* control = word_control(seg, offset + i, step);
+        if ((CTL_WRITE | id) == atomic_load(control)) {
+            stripe_read(seg, offset + i, part, ((Word*) target) + i, true, step);
         } else {
-            if (atomic_compare_exchange_strong(control, &expected, -tx )
-            // tx + batch_size)
-                // || expected == tx + batch_size
-                || expected == -tx
-                ) {
-                    memcpy(((Word*) target) + i , 
-                            seg -> data + offset + i, 
-                            sizeof(Word) * step);
+            if (unlikely(!txlog_reserve(&(desc -> log)))) {
+                desc_abort_why(desc, TM_ABORT_NOMEM, (const uint8_t*)source + i, invalid_tx);
+                Undo(region, desc);
+                return false;
+            }
+            // the contention manager may get the owner out of the way
+            enum Ctl_result marked;
+            while ((marked = ctl_read_mark(control, id)) == ctl_conflict
+                   && cm_resolve(region, desc, control));
+            if (marked != ctl_conflict) {
+                    if (marked == ctl_taken)
+                        txlog_push_word(&(desc -> log), seg, stripe_start(seg, offset + i), access_read);
+                    stripe_read(seg, offset + i, part, ((Word*) target) + i, false, step);
             } else {
-                    #ifdef _DEBUG_FLZ_TEST_UNDO_
-                    printf("tm_read: lock_read failed\n");
-                    printf("\toccupied by %d\n", expected); 
-                    #endif
+                ulong ctl = atomic_load(control);
+                log_debug("tm_read: lock_read failed, occupied by %lx", ctl);
+                tx_t owner = ctl_owner(region -> batcher, ctl);
+                desc_abort_why(desc, TM_ABORT_READ_WRITE, (const uint8_t*)source + i, owner);
+                heat_note(region, desc, seg, stripe_start(seg, offset + i), owner);
 
-                Undo(region, tx);
+                Undo(region, desc);
                 return false;
             }
         }
+        i += part;
     }
     
     return true; 
@@ -461,32 +598,48 @@ bool tm_write(shared_t shared, tx_t tx, void const* source, size_t size, void* t
     #ifdef _TO_USE_BATCHER_
 
     Region *region = (Region*)shared;
+    TxDesc* desc = (TxDesc*)tx;
+    trace_add(desc, trace_write, 0, size);
+
+    if (region -> engine == TM_ENGINE_TL2)
+        return tl2_write(region, &(desc -> tl2), source, size, target);
+
     Segment *seg = findSegment(region, target);
     if (seg == NULL){
-            #ifdef _DEBUG_FLZ_TEST_UNDO_
-            printf("tm_write: seg is NULL\n");
-            #endif
-        Undo(region, tx); 
+        log_debug("tm_write: no segment at %p", target);
+        desc_abort_why(desc, TM_ABORT_NO_SEGMENT, target, invalid_tx);
+        Undo(region, desc); 
         return false;
     }
 
-    if (!try_write(region, seg, tx, target, size)) {
-            #ifdef _DEBUG_FLZ_TEST_UNDO_
-            printf("tm_write: lock_write failed\n");
-            #endif
-        Undo(region, tx); 
+    if (cm_doomed(desc)) {
+        desc_abort_why(desc, TM_ABORT_KILLED, target, invalid_tx);
+        Undo(region, desc);
+        return false;
+    }
+    if (!try_write(region, seg, desc, target, size)) {
+        log_debug("tm_write: lock_write failed at %p", target);
+        Undo(region, desc); 
         return false;
     }
 
-        #ifdef _DEBUG_FLZ_TEST_WRITE_
-        printf("tm_write: %p -> (data)%p, (shadow)%p \n", source, target, 
-                                                          ((Word*) target) + (seg -> size) * sizeof(Word));
-        #endif
-
-    ulong offset = ((uintptr_t)target - (uintptr_t)seg -> data);
-    memcpy(seg -> shadow + offset,
-            source, 
-            size * sizeof(Word));
+    log_trace("tm_write: %p -> %p, %zu bytes, segment %p", source, target, size, (void*)seg);
+
+    ulong offset = seg_offset(target);
+    #ifdef _TO_USE_DUAL_COPY_
+    for (size_t i = 0; i < size; i += region -> align)
+        memcpy(word_writable(seg, offset + i, region -> align),
+                (Word*)source + i, 
+                sizeof(Word) * region -> align);
+    #else
+    for (size_t done = 0; done < size; ) {
+        size_t run = seg_run(seg, offset + done, size - done);
+        memcpy(word_shadow(seg, offset + done),
+                (Word const*)source + done, 
+                run * sizeof(Word));
+        done += run;
+    }
+    #endif
     // memcpy(((Word*) target) + (seg -> size) * sizeof(Word), 
     //                         // to the shadow
     //         source,
@@ -513,47 +666,42 @@ bool tm_write(shared_t shared, tx_t tx, void const* source, size_t size, void* t
 **/
 alloc_t tm_alloc(shared_t shared, tx_t tx, size_t size, void** target) {
     // TODO: tm_alloc(shared_t, tx_t, size_t, void**)
-    #ifdef _DEBUG_FLZ_
-    printf("start tm_alloc\n");
-    #endif
-
 
     Region *region = (Region*)shared;
     size_t align = region -> align;
+    TxDesc* desc = (TxDesc*)tx;
+
+    if (region -> engine == TM_ENGINE_TL2)
+        return tl2_alloc(region, &(desc -> tl2), size, target);
+
+    if (unlikely(!txlog_reserve(&(desc -> log))))
+        return nomem_alloc;
 
     // allocate a new segment
     // Words are appended to the end of the segment
-    Segment* seg; 
-    if (unlikely(posix_memalign((void**)&seg, align, sizeof(Segment) 
-                                                     + sizeof(atomic_tx) * size
-                                                     + sizeof(Word) * size * 2) != 0)) 
-    {
+    Segment* seg = Segment_alloc(size, align, region -> stripe, region -> layout);
+    if (unlikely(!seg))
         return nomem_alloc;
-    }
-    memset(seg, 0, sizeof(Segment) 
-                   + sizeof(atomic_tx) * size 
-                   + sizeof(Word) * size * 2 );
 
-    seg -> data = (Word*)((uintptr_t)seg + sizeof(Segment));
-    seg -> shadow = (Word*)((uintptr_t)seg -> data + sizeof(Word) * size);
-    seg -> control = (char*)((uintptr_t)seg -> shadow + sizeof(Word) * size);
+    // add creator
+    atomic_store(&(seg -> creator), desc -> id);
 
-    // add creator and size
-    atomic_store(&(seg -> creator), tx);
-    seg -> size = size;
+    // take a slot in the index, which gives the segment its addresses
+    if (unlikely(!index_insert(region, seg))) {
+        Segment_free(seg);
+        return nomem_alloc;
+    }
     
     // add to linked list
-    seg -> previous = NULL;
-    seg -> next = region -> allocs;
-    if (seg -> next) seg -> next -> previous = seg;
-    region -> allocs = seg;
+    seglist_push(region, seg);
 
-    *target = seg -> data;
+    // if we abort, the segment goes away
+    txlog_push(&(desc -> log), seg, 0, access_alloc);
+
+    *target = seg_vaddr(seg);
     // if (seg -> data == NULL)
     //     printf("failed to allocate\n");
-    #ifdef _DEBUG_FLZ_
-    printf("end tm_alloc\n");
-    #endif
+    log_trace("tm_alloc: %zu bytes at %p", size, *target);
 
     return success_alloc;
 
@@ -569,20 +717,41 @@ alloc_t tm_alloc(shared_t shared, tx_t tx, size_t size, void** target) {
 bool tm_free(shared_t shared, tx_t tx, void* target) {
     // printf("start tm_free: %x\n", target);
     Region *region = (Region*)shared;
+    TxDesc* desc = (TxDesc*)tx;
+
+    if (region -> engine == TM_ENGINE_TL2)
+        return tl2_free(region, &(desc -> tl2), target);
+
     Segment *seg = findSegment(region, target);
     if (seg == NULL){
-        Undo(region, tx); 
+        desc_abort_why(desc, TM_ABORT_NO_SEGMENT, target, invalid_tx);
+        Undo(region, desc); 
+        return false;
+    }
+    // the first segment lives as long as the region
+    if (unlikely(seg == region -> start)) {
+        desc_abort_why(desc, TM_ABORT_FREE, target, invalid_tx);
+        Undo(region, desc); 
         return false;
     }
 
-    char expected = it_is_free;
-    if (!atomic_compare_exchange_strong((&seg -> creator), &expected, tx) ||
-        expected == tx) {
-        Undo(region, tx); 
+    if (unlikely(!txlog_reserve(&(desc -> log)))) {
+        desc_abort_why(desc, TM_ABORT_NOMEM, target, invalid_tx);
+        Undo(region, desc); 
+        return false;
+    }
+
+    tx_t expected = it_is_free;
+    if (!atomic_compare_exchange_strong((&seg -> creator), &expected, desc -> id) ||
+        expected == desc -> id) {
+        desc_abort_why(desc, TM_ABORT_FREE, target, epoch_owner(region -> batcher, expected));
+        Undo(region, desc); 
         return false;
     }
 
     atomic_store(&(seg -> to_delete), true);
+    // if we abort, the segment is given back
+    txlog_push(&(desc -> log), seg, 0, access_free);
     return true; 
 
     // ==============================
@@ -606,3 +775,102 @@ bool tm_free(shared_t shared, tx_t tx, void* target) {
 
     return false;
 }
+
+/** [thread-safe] Snapshot of the batcher's state, to watch the epoch size adapt, of the segment pool
+ * and of the counters of the threads (_TO_USE_STATS_).
+ * @param shared Shared memory region to query
+ * @param stats  Structure to fill
+ * @return Whether the structure was filled
+**/
+bool tm_stats(shared_t shared, struct tm_stats* stats) {
+    Region *region = (Region*)shared;
+    if (unlikely(region == NULL || stats == NULL))
+        return false;
+
+    stats -> engine             = region -> engine;
+    stats -> layout             = region -> layout;
+    stats -> stripe             = region -> stripe;
+    stats -> cm                 = region -> cm;
+    Batcher *batcher = region -> batcher;
+    stats -> epoch_size         = atomic_load(&(batcher -> epoch_size));
+    stats -> epochs             = get_epoch(batcher);
+    stats -> waiting_writers    = atomic_load(&(batcher -> epoch_waiting));
+    stats -> abort_permille     = atomic_load(&(batcher -> avg_abort_permille));
+    stats -> commit_ns          = atomic_load(&(batcher -> avg_commit_ns));
+    stats -> epoch_ns           = atomic_load(&(batcher -> avg_epoch_ns));
+    stats -> cm_kills           = atomic_load(&(batcher -> cm_kills));
+
+    // the pool is shared by all regions
+    stats -> pool_in_use = stats -> pool_cached = stats -> pool_cached_bytes = 0;
+    for (int class = 0; class < POOL_CLASSES; ++class) {
+        ulong made, cached;
+        pool_occupancy(class, &made, &cached);
+        cached += desc_mags_cached(class);
+        cached = cached > made ? made : cached;
+        stats -> pool_in_use       += made - cached;
+        stats -> pool_cached       += cached;
+        stats -> pool_cached_bytes += cached * pool_class_bytes(class);
+    }
+
+    // so are the counters of the threads
+    TxStats sum;
+    desc_stats_sum(&sum);
+    #ifdef _TO_USE_STATS_
+    stats -> counting = true;
+    #else
+    stats -> counting = false;
+    #endif
+    stats -> commits        = atomic_load(&(sum.commits));
+    stats -> aborts         = atomic_load(&(sum.aborts));
+    ulong epochs            = atomic_load(&(sum.epochs));
+    stats -> epoch_occupancy_milli = epochs ? atomic_load(&(sum.epoch_writers)) * 1000 / epochs : 0;
+    stats -> tickets        = atomic_load(&(sum.tickets));
+    stats -> ticket_wait_ns = atomic_load(&(sum.ticket_ns));
+    stats -> commit_bytes   = atomic_load(&(sum.commit_bytes));
+    stats -> seg_allocs     = atomic_load(&(sum.seg_allocs));
+    stats -> seg_frees      = atomic_load(&(sum.seg_frees));
+    return true;
+}
+
+/** [thread-safe] Write the event trace of all threads, see trace_func.h.
+ * @param path File to (over)write
+ * @return Whether the file got written, always false without _TO_USE_TRACE_
+**/
+bool tm_trace_dump(const char* path) {
+    if (unlikely(path == NULL))
+        return false;
+    return trace_dump(path);
+}
+
+/** [thread-safe] Why the last transaction of the calling thread that aborted did.
+ * @param why Structure to fill
+ * @return Whether a transaction of the thread ever aborted
+**/
+bool tm_last_abort(struct tm_abort* why) {
+    TxDesc* desc = desc_self;
+    if (unlikely(why == NULL) || desc == NULL || desc -> why == TM_ABORT_NONE)
+        return false;
+    why -> reason  = desc -> why;
+    why -> address = desc -> why_address;
+    why -> owner   = desc -> why_owner;
+    return true;
+}
+
+/** [thread-safe] The most contended stripes or segments of a region, see heat_func.h.
+ * @param shared   Shared memory region to query
+ * @param top      Array to fill, most conflicts first
+ * @param n        Length of the array
+ * @param segments Whether to sum the conflicts per segment
+ * @return Entries filled, always 0 without _TO_USE_HEATMAP_
+**/
+size_t tm_heatmap(shared_t shared, struct tm_hot* top, size_t n, bool segments) {
+    Region *region = (Region*)shared;
+    if (unlikely(region == NULL || top == NULL))
+        return 0;
+    #ifdef _TO_USE_HEATMAP_
+    return heat_top(region -> heat, top, n, segments);
+    #else
+    (void)n; (void)segments;
+    return 0;
+    #endif
+}
@@ -0,0 +1,132 @@
+/**
+ * @file   tm_ext.h
+ * @author Qingyi HE <qingyi.he@epfl.ch>
+ *
+ * @section DESCRIPTION
+ *
+ * Extensions exported by this library on top of the tm.h interface.
+ * Programs that only know tm.h are not affected.
+**/
+
+#pragma once
+
+#include "Mytm.h"
+
+// -------------------------------------------------------------------------- //
+
+// Engines a region can run on, picked at tm_create from the TM_ENGINE
+// environment variable ("batcher" or "tl2"), TM_ENGINE_DEFAULT otherwise
+#define TM_ENGINE_BATCHER 0 // epochs of writers committed together (batcher_func.h)
+#define TM_ENGINE_TL2     1 // global version clock, commit-time validation (tl2_func.h)
+
+// Layouts of the segments, picked at tm_create from the TM_LAYOUT environment
+// variable ("split" or "interleaved"), TM_LAYOUT_DEFAULT otherwise
+#define TM_LAYOUT_SPLIT       0 // [data][shadow][control]: bulk copies are one memcpy
+#define TM_LAYOUT_INTERLEAVED 1 // per cache line of data: [data][shadow][control], one access stays local
+
+// The conflict granularity is a stripe of words sharing a control word, from
+// the TM_STRIPE environment variable (bytes, a power of two from the alignment
+// up to a cache line), TM_STRIPE_DEFAULT otherwise (0 for one word). TL2
+// regions always use one word.
+
+// Contention managers, i.e. what a transaction does about a word held by
+// another one, picked at tm_create from the TM_CM environment variable
+// ("abort", "backoff", "timestamp" or "karma"), TM_CM_DEFAULT otherwise
+#define TM_CM_ABORT     0 // roll back right away and retry
+#define TM_CM_BACKOFF   1 // roll back, wait a random time growing with the retries, retry
+#define TM_CM_TIMESTAMP 2 // the transaction that began first has the other one roll back
+#define TM_CM_KARMA     3 // the transaction that accessed more words over its retries wins
+
+// Why a transaction rolled back, see tm_last_abort
+#define TM_ABORT_NONE        0 // the thread never saw a transaction abort
+#define TM_ABORT_READ_WRITE  1 // a read met a word another transaction writes
+#define TM_ABORT_WRITE_READ  2 // a write met a word other transactions read
+#define TM_ABORT_WRITE_WRITE 3 // a write met a word another transaction writes
+#define TM_ABORT_NO_SEGMENT  4 // the address is in no segment (never allocated, or freed)
+#define TM_ABORT_FREE        5 // the segment cannot be freed by this transaction (first segment, or taken by another one)
+#define TM_ABORT_SNAPSHOT    6 // a read-only transaction lost its snapshot to commits
+#define TM_ABORT_VALIDATION  7 // a word read got committed to before the end (TL2)
+#define TM_ABORT_KILLED      8 // the contention manager made way for another transaction
+#define TM_ABORT_NOMEM       9 // no memory left to keep track of the accesses
+
+/// @brief last abort of a thread, see tm_last_abort
+struct tm_abort {
+    /// @brief TM_ABORT_*
+    int reason;
+    /// @brief shared address of the access that failed, NULL if none
+    const void* address;
+    /// @brief transaction (as tm_begin returned it) holding the word, invalid_tx if not
+    /// known (e.g. several readers), it may have ended since
+    tx_t owner;
+};
+
+/// @brief a contended stripe (or segment) of the region, see tm_heatmap
+struct tm_hot {
+    /// @brief shared address of the stripe (or of the segment)
+    const void* address;
+    /// @brief conflicts sampled on it
+    unsigned long conflicts;
+    /// @brief transaction that held it at the last one, invalid_tx if not known
+    tx_t owner;
+};
+
+/// @brief snapshot of the batcher, of the segment pool and of the thread counters, see tm_stats
+struct tm_stats {
+    /// @brief TM_ENGINE_* running the region, the other fields are only filled for the batcher
+    int engine;
+    /// @brief TM_LAYOUT_* of the segments of the region
+    int layout;
+    /// @brief bytes covered by a control word
+    unsigned long stripe;
+    /// @brief TM_CM_* of the region
+    int cm;
+    /// @brief transactions rolled back so that another one could go on
+    unsigned long cm_kills;
+    /// @brief writers admitted per epoch right now
+    unsigned long epoch_size;
+    /// @brief epochs completed so far
+    unsigned long epochs;
+    /// @brief writers waiting for the current epoch to end
+    unsigned long waiting_writers;
+    /// @brief smoothed abort rate of writers, per mille
+    unsigned long abort_permille;
+    /// @brief smoothed time spent committing an epoch (ns)
+    unsigned long commit_ns;
+    /// @brief smoothed length of a writing epoch (ns)
+    unsigned long epoch_ns;
+    /// @brief segments of the process served by the pool and not freed yet (all engines, all regions)
+    unsigned long pool_in_use;
+    /// @brief pool blocks ready to be reused, in the shared pool or in the threads' magazines
+    unsigned long pool_cached;
+    /// @brief memory held by these blocks (bytes)
+    unsigned long pool_cached_bytes;
+    /// @brief whether the library counts the fields below (built with _TO_USE_STATS_),
+    /// they are 0 otherwise; counted per thread and summed over all threads (all regions)
+    int counting;
+    /// @brief transactions committed and aborted
+    unsigned long commits;
+    unsigned long aborts;
+    /// @brief average writers admitted in a committed epoch, in thousandths
+    unsigned long epoch_occupancy_milli;
+    /// @brief turns of the batcher taken, and the time spent waiting for them (ns)
+    unsigned long tickets;
+    unsigned long ticket_wait_ns;
+    /// @brief bytes of data the commits applied
+    unsigned long commit_bytes;
+    /// @brief segments whose allocation or freeing got committed
+    unsigned long seg_allocs;
+    unsigned long seg_frees;
+};
+
+// -------------------------------------------------------------------------- //
+
+bool tm_stats(shared_t, struct tm_stats*);
+// Writes the event trace of all threads as Chrome trace JSON (built with _TO_USE_TRACE_,
+// see trace_func.h), false if the file cannot be written or tracing is off
+bool tm_trace_dump(const char*);
+// Why the last transaction of the calling thread that aborted did, false if none did
+bool tm_last_abort(struct tm_abort*);
+// Fills the given array with the stripes (or, if the last argument is true, the segments)
+// of the region with the most conflicts, most first; returns how many were filled (built
+// with _TO_USE_HEATMAP_, see heat_func.h, 0 otherwise)
+size_t tm_heatmap(shared_t, struct tm_hot*, size_t, bool);
@@ -0,0 +1,169 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+// Event trace (_TO_USE_TRACE_): every thread records what its transactions
+// do, stamped with the time stamp counter, in a ring of the last TRACE_RING
+// events in its descriptor. tm_trace_dump writes the rings of all threads as
+// Chrome trace JSON (chrome://tracing, Perfetto), and so does the unloading of
+// the library if the TM_TRACE environment variable names a file. Without the
+// switch, every function here is empty.
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "structs.h"
+#include "desc_func.h"
+#include "macros.h"
+
+#ifdef _TO_USE_TRACE_
+
+static const char* const trace_names[] = {
+    [trace_tx]     = "tx",
+    [trace_ticket] = "ticket",
+    [trace_read]   = "read",
+    [trace_write]  = "write",
+    [trace_abort]  = "abort",
+    [trace_epoch]  = "epoch end",
+    [trace_commit] = "Commit",
+};
+
+/// @brief time stamp counter and clock when the library was loaded, to convert ticks
+static ulong trace_origin_tsc;
+static ulong trace_origin_ns;
+
+#endif
+
+/** Time stamp counter (the monotonic clock in ns where there is none), 0 without tracing.
+**/
+static inline ulong trace_clock(void) {
+    #if !defined(_TO_USE_TRACE_)
+    return 0;
+    #elif defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+    #else
+    return now_ns();
+    #endif
+}
+
+/** Record an event in the ring of the thread.
+ * @param desc  Descriptor of the thread
+ * @param kind  Trace_kind
+ * @param start trace_clock when the span began, 0 for an instant event
+ * @param arg   Detail of the event (see TraceEvent)
+**/
+static inline void trace_add(TxDesc* desc, enum Trace_kind kind, ulong start, ulong arg) {
+    #ifdef _TO_USE_TRACE_
+    if (unlikely(desc -> trace == NULL)) {
+        desc -> trace = (TraceEvent*)malloc(sizeof(TraceEvent) * TRACE_RING);
+        if (desc -> trace == NULL)
+            return;
+    }
+    ulong now = trace_clock();
+    ulong count = atomic_load_explicit(&(desc -> trace_count), memory_order_relaxed);
+    TraceEvent* event = desc -> trace + (count & (TRACE_RING - 1));
+    event -> tsc   = start != 0 ? start : now;
+    event -> ticks = start != 0 ? now - start : 0;
+    event -> kind  = kind;
+    event -> arg   = (uint32_t)arg;
+    atomic_store_explicit(&(desc -> trace_count), count + 1, memory_order_release);
+    #else
+    (void)desc; (void)kind; (void)start; (void)arg;
+    #endif
+}
+
+/** The transaction of the thread begins, see trace_tx_end.
+**/
+static inline void trace_tx_begin(TxDesc* desc) {
+    #ifdef _TO_USE_TRACE_
+    desc -> trace_begin = trace_clock();
+    #else
+    (void)desc;
+    #endif
+}
+
+/** The transaction of the thread is over (called by desc_done).
+ * @param desc      Descriptor of the thread
+ * @param committed Whether it committed
+**/
+static inline void trace_tx_end(TxDesc* desc, bool committed) {
+    #ifdef _TO_USE_TRACE_
+    if (!committed)
+        trace_add(desc, trace_abort, 0, 0);
+    trace_add(desc, trace_tx, desc -> trace_begin, committed);
+    #else
+    (void)desc; (void)committed;
+    #endif
+}
+
+#ifdef _TO_USE_TRACE_
+
+/** Write the rings of all threads as Chrome trace JSON. Events recorded meanwhile may come
+ * out garbled, dump while the threads are quiet for an exact trace.
+ * @param path File to (over)write
+ * @return Whether the file got written
+**/
+static bool trace_dump(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL)
+        return false;
+
+    // ticks per ns since the library was loaded
+    double ticks_per_ns = 1.0;
+    #if defined(__x86_64__) || defined(__i386__)
+    ulong elapsed_ns = now_ns() - trace_origin_ns;
+    if (elapsed_ns != 0)
+        ticks_per_ns = (double)(trace_clock() - trace_origin_tsc) / (double)elapsed_ns;
+    #endif
+
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    bool first = true;
+    ulong tid = 0;
+    for (TxDesc* desc = atomic_load(&desc_all); desc != NULL; desc = desc -> next_all, ++tid) {
+        ulong count = atomic_load_explicit(&(desc -> trace_count), memory_order_acquire);
+        if (desc -> trace == NULL || count == 0)
+            continue;
+        ulong oldest = count > TRACE_RING ? count - TRACE_RING : 0;
+        for (ulong n = oldest; n < count; ++n) {
+            const TraceEvent* event = desc -> trace + (n & (TRACE_RING - 1));
+            // microseconds since the library was loaded
+            double ts = (double)(long)(event -> tsc - trace_origin_tsc) / ticks_per_ns / 1000.0;
+            fprintf(file, "%s\n{\"name\":\"%s\",\"pid\":1,\"tid\":%lu,\"ts\":%.3f,",
+                    first ? "" : ",", trace_names[event -> kind], tid, ts);
+            if (event -> kind == trace_tx || event -> kind == trace_ticket || event -> kind == trace_commit)
+                fprintf(file, "\"ph\":\"X\",\"dur\":%.3f,", (double)event -> ticks / ticks_per_ns / 1000.0);
+            else
+                fprintf(file, "\"ph\":\"i\",\"s\":\"t\",");
+            fprintf(file, "\"args\":{\"arg\":%u}}", event -> arg);
+            first = false;
+        }
+    }
+    fprintf(file, "\n]}\n");
+    return fclose(file) == 0;
+}
+
+__attribute__((constructor)) static void trace_load(void) {
+    trace_origin_tsc = trace_clock();
+    trace_origin_ns = now_ns();
+}
+
+__attribute__((destructor)) static void trace_unload(void) {
+    const char* path = getenv("TM_TRACE");
+    if (path != NULL && *path != '\0' && !trace_dump(path))
+        fprintf(stderr, "tm: cannot write the trace to %s\n", path);
+}
+
+#else
+
+static inline bool trace_dump(const char* path) {
+    (void)path;
+    return false;
+}
+
+#endif
+
+#endif